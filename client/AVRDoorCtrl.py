@@ -132,6 +132,19 @@ class AVRDoorCtrlSerialHandler(object):
     CMD_SET_ACCESS = 22
     CMD_REMOVE_ALL_ACCESS = 23
     CMD_GET_ACCESS = 24
+    CMD_SET_ACCESS_BATCH = 25
+    CMD_GET_ACCESS_RECORDS = 26
+    CMD_SET_ACCESS_FORMAT = 27
+    CMD_GET_ACCESS_BOOT_WRITE_COUNTS = 28
+    CMD_GET_EVENT_STATS = 29
+    CMD_GET_TIMER_STATS = 30
+    CMD_GET_READER_STATS = 31
+
+    READER_STATS_WORDS = [ 'key4', 'key8', 'h10301', 'h10306',
+                           'c1000_35', 'h10304', 'other' ]
+
+    MAX_PAYLOAD_SIZE = 48
+    SET_ACCESS_BATCH_MAX = MAX_PAYLOAD_SIZE // 5
 
     EVENT_BASE = 127
     EVENT_STARTED = EVENT_BASE + 0
@@ -146,6 +159,9 @@ class AVRDoorCtrlSerialHandler(object):
     ACCESS_TYPE_CARD = 2
     ACCESS_TYPE_CARD_AND_PIN = ACCESS_TYPE_CARD | ACCESS_TYPE_PIN
 
+    ACCESS_FORMAT_V1 = 1
+    ACCESS_FORMAT_V2 = 2
+
     def __init__(self, dev, *args, **kwargs):
         if dev.startswith('/dev/tty'):
             self._transport = AVRDoorCtrlUartTransport(dev, *args, **kwargs)
@@ -214,34 +230,45 @@ class AVRDoorCtrlSerialHandler(object):
         }
         if len(response) > 5:
             ret["free_access_records"], = struct.unpack("<H", response[5:7])
+        if len(response) > 7:
+            ret["acl_generation"], ret["acl_hash"] = \
+                struct.unpack("<HH", response[7:11])
+        if len(response) > 11:
+            ret["access_format"], = struct.unpack("<B", response[11:12])
+        else:
+            ret["access_format"] = self.ACCESS_FORMAT_V1
+        if len(response) > 12:
+            ret["max_payload_size"], = struct.unpack("<B", response[12:13])
+        else:
+            ret["max_payload_size"] = self.MAX_PAYLOAD_SIZE
         return ret
 
     def get_door_config(self, index):
         response = self.send_cmd(self.CMD_GET_DOOR_CONFIG,
-                                 struct.pack("<B", int(index)), 7)
+                                 struct.pack("<B", int(index)), 8)
         open_time, = struct.unpack("<H", response[0:2])
+        wiegand_formats, = struct.unpack("<B", response[7:8])
         ret = {
             "open_time": open_time,
+            "wiegand_formats": wiegand_formats,
         }
         return ret
 
-    def set_door_config(self, index, open_time):
-        req = struct.pack("<BHHHB", int(index), int(open_time), 0, 0, 0)
+    def set_door_config(self, index, open_time, wiegand_formats = 0xFF):
+        req = struct.pack("<BHHHBB", int(index), int(open_time), 0, 0, 0,
+                          int(wiegand_formats))
         self.send_cmd(self.CMD_SET_DOOR_CONFIG, req)
         return {}
 
-    def get_access_record(self, index, pin = None, card = None):
-        response = self.send_cmd(self.CMD_GET_ACCESS_RECORD,
-                                 struct.pack("<H", int(index)), 5)
-        key, access = struct.unpack("<LB", response[0:5])
+    @classmethod
+    def _unpack_access_record(self, data, pin = None, card = None):
+        key, access = struct.unpack("<LB", data[0:5])
         # If the record is invalid ignore it
         if access & (1 << 2):
             access = 0
         type = access & 0x3
         doors = (access >> 4) & 0xF
-        ret = {
-            "index": index,
-        }
+        ret = {}
         if type != self.ACCESS_TYPE_NONE:
             ret['doors'] = doors
         if type == self.ACCESS_TYPE_PIN:
@@ -259,6 +286,99 @@ class AVRDoorCtrlSerialHandler(object):
                 ret['card+pin'] = key
         return ret
 
+    def get_access_record(self, index, pin = None, card = None):
+        response = self.send_cmd(self.CMD_GET_ACCESS_RECORD,
+                                 struct.pack("<H", int(index)), 5)
+        ret = {
+            "index": index,
+        }
+        ret.update(self._unpack_access_record(response, pin, card))
+        return ret
+
+    def get_access_records(self, start, count = 0):
+        response = self.send_cmd(self.CMD_GET_ACCESS_RECORDS,
+                                 struct.pack("<HB", int(start), int(count)),
+                                 3)
+        next, count = struct.unpack("<HB", response[0:3])
+        records = []
+        for i in range(count):
+            entry = response[3 + i * 7:3 + (i + 1) * 7]
+            index, = struct.unpack("<H", entry[0:2])
+            record = {
+                "index": index,
+            }
+            record.update(self._unpack_access_record(entry[2:]))
+            records.append(record)
+        return {
+            'next': next,
+            'records': records,
+        }
+
+    def get_access_boot_write_counts(self, start, count = 0):
+        response = self.send_cmd(self.CMD_GET_ACCESS_BOOT_WRITE_COUNTS,
+                                 struct.pack("<HB", int(start), int(count)),
+                                 3)
+        start, count = struct.unpack("<HB", response[0:3])
+        return {
+            'start': start,
+            'counts': list(bytearray(response[3:3 + count])),
+        }
+
+    def get_event_stats(self):
+        response = self.send_cmd(self.CMD_GET_EVENT_STATS, None, 8)
+        events, drops, depth, max_depth, queue_size, num_sources = \
+            struct.unpack("<HHBBBB", response[0:8])
+        sources = []
+        for i in range(num_sources):
+            source, src_events, src_drops = \
+                struct.unpack("<BHH", response[8 + i * 5:13 + i * 5])
+            sources.append({
+                'source': source,
+                'events': src_events,
+                'drops': src_drops,
+            })
+        return {
+            'events': events,
+            'drops': drops,
+            'depth': depth,
+            'max_depth': max_depth,
+            'queue_size': queue_size,
+            'sources': sources,
+        }
+
+    def get_timer_stats(self, reset = False):
+        response = self.send_cmd(self.CMD_GET_TIMER_STATS,
+                                 struct.pack("<B", 1 if reset else 0), 24)
+        fields = struct.unpack("<8HHHHBB", response[0:24])
+        return {
+            'lateness': list(fields[0:8]),
+            'max_lateness': fields[8],
+            'max_isr': fields[9],
+            'max_callback': fields[10],
+            'max_pending': fields[11],
+            'max_timers': fields[12],
+        }
+
+    def get_reader_stats(self, index, reset = False):
+        response = self.send_cmd(self.CMD_GET_READER_STATS,
+                                 struct.pack("<BB", index,
+                                             1 if reset else 0), 35)
+        fields = struct.unpack("<7H6HLLb", response[0:35])
+        stats = {
+            'index': index,
+            'words': dict(zip(self.READER_STATS_WORDS, fields[0:7])),
+            'parity_errors': fields[7],
+            'unsupported': fields[8],
+            'pulse_errors': fields[9],
+            'overflows': fields[10],
+            'ring_overflows': fields[11],
+            'disconnects': fields[12],
+        }
+        if fields[15]:
+            stats['last_error'] = -fields[15]
+            stats['last_error_age'] = (fields[14] - fields[13]) & 0xffffffff
+        return stats
+
     @classmethod
     def _pack_access_record(self, pin = None, card = None,
                             doors = 0, card_pin = None):
@@ -295,6 +415,22 @@ class AVRDoorCtrlSerialHandler(object):
         self.send_cmd(self.CMD_SET_ACCESS, req, 0)
         return {}
 
+    def set_access_batch(self, records):
+        if len(records) < 1 or len(records) > self.SET_ACCESS_BATCH_MAX:
+            raise ValueError('Invalid number of records')
+        req = b''
+        for r in records:
+            if r.get('pin') == None and r.get('card') == None and \
+               r.get('card+pin') == None:
+                raise ValueError('No card number or pin given')
+            req += self._pack_access_record(r.get('pin'), r.get('card'),
+                                            r.get('doors', 0),
+                                            r.get('card+pin'))
+        response = self.send_cmd(self.CMD_SET_ACCESS_BATCH, req, 2)
+        return {
+            'failed': struct.unpack('<H', response[0:2])[0],
+        }
+
     def get_access(self, pin = None, card = None):
         if pin == None and card == None:
             raise ValueError('No card number or pin given')
@@ -308,6 +444,48 @@ class AVRDoorCtrlSerialHandler(object):
         self.send_cmd(self.CMD_REMOVE_ALL_ACCESS)
         return {}
 
+    def set_access_format(self, format):
+        self.send_cmd(self.CMD_SET_ACCESS_FORMAT,
+                      struct.pack("<B", int(format)))
+        return {}
+
+    @classmethod
+    def access_record_fits(self, record, format):
+        """
+        Check if a record can be stored in the given access format.
+        """
+        if format == self.ACCESS_FORMAT_V1:
+            return True
+        data = self._pack_access_record(record.get('pin'),
+                                        record.get('card'),
+                                        record.get('doors', 0),
+                                        record.get('card+pin'))
+        key, = struct.unpack("<l", data[0:4])
+        # Keys are 26 bits, sign extended, and only 2 doors are stored
+        return -(1 << 25) <= key < (1 << 25) and \
+            record.get('doors', 0) < (1 << 2)
+
+def acl_hash(records):
+    """
+    Compute the ACL hash reported in the device descriptor from a list
+    of records with a card and/or pin and the doors.
+    """
+    h = 0
+    for r in records:
+        if not r.get('doors'):
+            continue
+        data = AVRDoorCtrlSerialHandler._pack_access_record(
+            r.get('pin'), r.get('card'), r['doors'])
+        d = AVRDoorCtrlUartTransport.compute_crc(data)
+        # Mix the CRC as it is linear, see eeprom_access_digest()
+        d ^= d >> 8
+        d = (d * 0x88B5) & 0xFFFF
+        d ^= d >> 7
+        d = (d * 0xDB2D) & 0xFFFF
+        d ^= d >> 9
+        h = (h + d) & 0xFFFF
+    return h
+
 class AVRDoorCtrlUbusHandler(ubus.UObject):
     def __init__(self, url, username, password,
                  uobject = None, **ubus_kwargs):
@@ -327,13 +505,34 @@ class AVRDoorCtrlUbusHandler(ubus.UObject):
         pass
 
     @ubus.method
-    def set_door_config(self, index: int, open_time: int):
+    def set_door_config(self, index: int, open_time: int,
+                        wiegand_formats: int = 0xFF):
         pass
 
     @ubus.method
     def get_access_record(self, index: int):
         pass
 
+    @ubus.method
+    def get_access_records(self, start: int, count: int = 0):
+        pass
+
+    @ubus.method
+    def get_access_boot_write_counts(self, start: int, count: int = 0):
+        pass
+
+    @ubus.method
+    def get_event_stats(self):
+        pass
+
+    @ubus.method
+    def get_timer_stats(self, reset: bool = False):
+        pass
+
+    @ubus.method
+    def get_reader_stats(self, index: int, reset: bool = False):
+        pass
+
     @ubus.method
     def set_access_record(self, index: int, pin: str = None,
                           card: int = None, doors: int = 0):
@@ -343,6 +542,10 @@ class AVRDoorCtrlUbusHandler(ubus.UObject):
     def set_access(self, pin: str = None, card: int = None, doors: int = 0):
         pass
 
+    @ubus.method
+    def set_access_batch(self, records: list):
+        pass
+
     @ubus.method
     def get_access(self, pin: str = None, card: int = None):
         pass
@@ -351,6 +554,10 @@ class AVRDoorCtrlUbusHandler(ubus.UObject):
     def remove_all_access(self):
         pass
 
+    @ubus.method
+    def set_access_format(self, format: int):
+        pass
+
 class AVRDoorCtrl(object):
     """
     Proxy class that select an implementation depending on the type
@@ -370,12 +577,70 @@ class AVRDoorCtrl(object):
     def get_all_access_records(self):
         desc = self.get_device_descriptor()
         acl = {}
-        for i in range(desc["num_access_records"]):
-            a = self.get_access_record(index=i)
-            if 'doors' in a:
-                acl[i] = a
+        next = 0
+        while next < desc["num_access_records"]:
+            resp = self.get_access_records(start=next)
+            for a in resp['records']:
+                if 'doors' in a:
+                    acl[a['index']] = a
+            if resp['next'] <= next:
+                break
+            next = resp['next']
         return acl
 
+    def get_all_access_boot_write_counts(self):
+        desc = self.get_device_descriptor()
+        counts = []
+        while len(counts) < desc["num_access_records"]:
+            resp = self.get_access_boot_write_counts(start=len(counts))
+            if not resp['counts']:
+                break
+            counts += resp['counts']
+        return counts
+
+    def set_access_list(self, records):
+        """
+        Set the access of a list of records, using as few commands
+        as possible. Return the list of records that failed.
+        """
+        failed = []
+        desc = self.get_device_descriptor()
+        step = desc.get('max_payload_size',
+                        AVRDoorCtrlSerialHandler.MAX_PAYLOAD_SIZE) // 5
+        for i in range(0, len(records), step):
+            batch = records[i:i+step]
+            mask = self.set_access_batch(records=batch)['failed']
+            for j in range(len(batch)):
+                if mask & (1 << j):
+                    failed.append(batch[j])
+        return failed
+
+    def migrate_access_format(self, format):
+        """
+        Switch the controller to another access record format. Changing
+        the format erase all the records, so they are read out first and
+        then uploaded again.
+        """
+        format = int(format)
+        desc = self.get_device_descriptor()
+        if desc.get('access_format') == format:
+            return {}
+        acl = self.get_all_access_records()
+        records = []
+        for idx in acl:
+            record = dict(acl[idx])
+            del record['index']
+            if not AVRDoorCtrlSerialHandler.access_record_fits(
+                    record, format):
+                raise ValueError('Record %d does not fit in format %d' %
+                                 (idx, format))
+            records.append(record)
+        self.set_access_format(format=format)
+        failed = self.set_access_list(records)
+        if failed:
+            raise RuntimeError('Failed to restore %d records' % len(failed))
+        return {}
+
     def set_all_access_records(self, acl):
         self.remove_all_access()
         for idx in acl:
@@ -444,6 +709,12 @@ if __name__ == '__main__':
     method_parser.add_argument(
         '--open_time', metavar = 'TIME', type = int, required = True,
         help = 'Time to keep the door open, in milliseconds')
+    method_parser.add_argument(
+        '--wiegand_formats', metavar = 'MASK', type = int, default = 0xFF,
+        help = 'Bitmask of the accepted card formats: 1 for 26 bits, ' +
+        '2 for 34 bits, 4 for 35 bits Corporate 1000 and 8 for 37 bits ' +
+        '(only facility codes under 8192). ' +
+        'The default is 255, which select the firmware default formats')
 
     method_parser = method_subparsers.add_parser(
         'get_access_record', help = 'Get an access record')
@@ -484,6 +755,37 @@ if __name__ == '__main__':
     method_parser = method_subparsers.add_parser(
         'remove_all_access', help = 'Erase all access records')
 
+    method_parser = method_subparsers.add_parser(
+        'get_event_stats', help = 'Get the event queue statistics')
+
+    method_parser = method_subparsers.add_parser(
+        'get_timer_stats',
+        help = 'Get the timers statistics, the firmware must be ' +
+        'built with TIMER_STATS=1')
+    method_parser.add_argument(
+        '--reset', action = 'store_true',
+        help = 'Reset the statistics after reading them')
+
+    method_parser = method_subparsers.add_parser(
+        'get_reader_stats', help = 'Get the Wiegand reader statistics')
+    method_parser.add_argument(
+        '--index', type = int, required = True, help = 'Door index')
+    method_parser.add_argument(
+        '--reset', action = 'store_true',
+        help = 'Reset the statistics after reading them')
+
+    method_parser = method_subparsers.add_parser(
+        'get_all_access_boot_write_counts',
+        help = 'Get the number of writes to each access record since boot')
+
+    method_parser = method_subparsers.add_parser(
+        'migrate_access_format',
+        help = 'Switch the access records to another storage format')
+    method_parser.add_argument(
+        'format', type = int, choices = [ 1, 2 ],
+        help = 'Format 2 fit more records, but only support cards up ' +
+        'to 25 bits, PINs up to 6 digits and 2 doors')
+
     method_parser = method_subparsers.add_parser(
         'show_events', help = 'Show the events received from the controller')
 
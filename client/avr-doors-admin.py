@@ -28,15 +28,18 @@ class Controller(AVRDoorsDB.Controller):
         self.max_acl = desc["num_access_records"]
         self.save()
 
-    def set_access(self, card = None, pin = None, doors = 0):
+    @staticmethod
+    def _access_args(card, pin, doors):
         args = { 'doors': doors }
         if card != None:
             args['card'] = card
         if pin != None:
             args['pin'] = pin
+        return args
+
+    def _set_acl_entry(self, cursor, card, pin, doors):
         # Delete any old record, this is always needed as we have
         # no proper primary key because card or pin could be null
-        cursor = self._db.cursor()
         cursor.execute(
             "delete from ControllerSetACL where " +
             "ControllerID = %s and Card <=> %s and PIN <=> %s",
@@ -47,15 +50,42 @@ class Controller(AVRDoorsDB.Controller):
                 "insert into ControllerSetACL set " +
                 "ControllerID = %s, Card = %s, PIN = %s, Doors = %s",
                 (self.id, card, pin, doors));
+
+    def set_access(self, card = None, pin = None, doors = 0):
+        cursor = self._db.cursor()
+        self._set_acl_entry(cursor, card, pin, doors)
         # Apply the changes on the device and commit to the DB
         try:
-            self.device.set_access(**args)
+            self.device.set_access(**self._access_args(card, pin, doors))
         except:
             self._db.rollback()
             raise
         else:
             self._db.commit()
 
+    def set_access_list(self, changes):
+        """
+        Apply a list of (card, pin, doors) changes using batched
+        commands and return the list of changes that failed.
+        """
+        records = [ self._access_args(*c) for c in changes ]
+        failed = [ id(r) for r in self.device.set_access_list(records) ]
+        cursor = self._db.cursor()
+        for change, record in zip(changes, records):
+            if id(record) not in failed:
+                self._set_acl_entry(cursor, *change)
+        self._db.commit()
+        return [ c for c, r in zip(changes, records) if id(r) in failed ]
+
+    def acl_hash(self, table):
+        cursor = self._db.cursor()
+        cursor.execute(
+            "select Card, PIN, Doors from " + table +
+            " where ControllerID = %s", (self.id,))
+        return AVRDoorCtrl.acl_hash(
+            [ self._access_args(card, pin, int(doors))
+              for card, pin, doors in cursor ])
+
     def describe_acl(self, card, pin, doors_mask):
         if card is not None:
             try:
@@ -82,9 +112,10 @@ class Controller(AVRDoorsDB.Controller):
     def update_acl(self, reset = False, dry_run = False):
         # Check if we can access the controller, if not there is no point
         # in trying to update any ACL.
+        desc = None
         try:
             if dry_run is False:
-                self.device.get_device_descriptor()
+                desc = self.device.get_device_descriptor()
         except Exception as err:
             msg = str(err) or type(err).__name__
             print("Skipping %s, controller is not accessible: %s" %
@@ -92,6 +123,15 @@ class Controller(AVRDoorsDB.Controller):
             return
         # Get the list of changes to apply, sort by doors for the presentation
         cursor = self._db.cursor()
+        # Check that the controller really has the ACL we think it has
+        if desc is not None and 'acl_hash' in desc and reset is False:
+            if desc['acl_hash'] != self.acl_hash("ControllerSetACL"):
+                print("WARNING: ACL on %s differs from the database " %
+                      self.location + "(generation %d), consider a reset" %
+                      desc['acl_generation'])
+            elif desc['acl_hash'] == self.acl_hash("ControllerACL"):
+                print("ACL on %s is up to date" % self.location)
+                return
         if reset is True:
             print("Removing all ACL on %s" % self.location)
             if dry_run is True:
@@ -111,22 +151,29 @@ class Controller(AVRDoorsDB.Controller):
             "select Op, Card, PIN, Doors from ControllerChanges " +
             "where ControllerID = %s order by Op, Doors, Card, PIN",
             (self.id,));
-        # Apply each access update
+        changes = [ (int(add), card, pin, int(doors))
+                    for add, card, pin, doors in cursor ]
+        # Apply all the access updates in batches
+        failed = []
+        if dry_run is False and len(changes) > 0:
+            try:
+                failed = self.set_access_list(
+                    [ (card, pin, add * doors)
+                      for add, card, pin, doors in changes ])
+            except Exception as e:
+                print("Failed to update the ACL on %s: %s" %
+                      (self.location, e))
+                return
+        # Report each access update
         last_access = None
-        for add, card, pin, doors in cursor:
-            # Convert to int to allow bit operations
-            doors = int(doors)
-            add = int(add)
+        for add, card, pin, doors in changes:
             access, who = self.describe_acl(card, pin, doors)
             if access != last_access:
                 print("%s:" % access)
             last_access = access
-            try:
-                if dry_run is False:
-                    self.set_access(card, pin, add * doors)
-            except Exception as e:
+            if (card, pin, add * doors) in failed:
                 op = "add" if add else "remove"
-                print("\t* Failed to %s %s: %s" % (op, who, e))
+                print("\t* Failed to %s %s" % (op, who))
             else:
                 op = "Added" if add else "Removed"
                 print("\t* %s %s" % (op, who))
@@ -24,7 +24,9 @@
 #include "avr-door-controller-daemon.h"
 #include "../firmware/ctrl-cmd-types.h"
 
-#define AVR_DOOR_CTRL_REQUEST_TIMEOUT 500
+/* Changing the access record format erase the whole EEPROM
+ * before replying, this takes up to 3.5s on the biggest MCU. */
+#define AVR_DOOR_CTRL_REQUEST_TIMEOUT 4000
 
 struct avr_door_ctrld;
 
@@ -119,6 +121,7 @@ int avr_door_ctrl_method_handler(
 	struct avr_door_ctrl *ctrl = container_of(
 		uobj, struct avr_door_ctrl, uobject);
 	struct avr_door_ctrl_request *req;
+	unsigned int query_size;
 	int i, err;
 
 	if (!method) {
@@ -153,16 +156,19 @@ int avr_door_ctrl_method_handler(
 
 	/* Write the contorl request */
 	req->msg.type = method->cmd;
-	req->msg.length = method->query_size;
+	query_size = method->query_size;
 
 	if (method->write_query) {
-		err = method->write_query(args, req->msg.payload, &req->bbuf);
+		err = method->write_query(args, req->msg.payload,
+					  &query_size, &req->bbuf);
 		if (err) {
 			free(req);
 			return err;
 		}
 	}
 
+	req->msg.length = query_size;
+
 	/* Add the request to pending list */
 	ubus_defer_request(ctrl->daemon->uctx, ureq, &req->uresp);
 	list_add_tail(&req->list, &ctrl->pending_reqs);
@@ -202,7 +208,8 @@ static void avr_door_ctrl_recv_msg(
 	}
 
 	if (req->method->read_response)
-		err = req->method->read_response(msg->payload, &req->bbuf);
+		err = req->method->read_response(msg->payload, msg->length,
+						 &req->bbuf);
 	if (!err)
 		err = ubus_send_reply(ctrl->daemon->uctx,
 				      &req->uresp, req->bbuf.head);
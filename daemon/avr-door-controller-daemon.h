@@ -16,7 +16,7 @@
 #include <stdint.h>
 #include <libubus.h>
 
-#define AVR_DOOR_CTRL_MSG_MAX_PAYLOAD_SIZE	16
+#define AVR_DOOR_CTRL_MSG_MAX_PAYLOAD_SIZE	48
 #define AVR_DOOR_CTRL_METHOD_MAX_ARGS		8
 
 struct avr_door_ctrld;
@@ -38,13 +38,18 @@ struct avr_door_ctrl_method {
 	/* Controller side */
 	unsigned int cmd;
 
-	/* Convert a ubus query to controller command */
+	/* Convert a ubus query to controller command, query_size is
+	 * initialized with the method query_size and can be changed
+	 * for queries with a variable length. */
 	int (*write_query)(struct blob_attr *const *const args,
-			   void *query, struct blob_buf *bbuf);
+			   void *query, unsigned int *query_size,
+			   struct blob_buf *bbuf);
 	unsigned int query_size;
 
-	/* Convert a controller response to a ubus one */
-	int (*read_response)(const void *response, struct blob_buf *bbuf);
+	/* Convert a controller response to a ubus one, length is the
+	 * received length, at least response_size. */
+	int (*read_response)(const void *response, unsigned int length,
+			     struct blob_buf *bbuf);
 	unsigned int response_size;
 };
 
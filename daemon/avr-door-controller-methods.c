@@ -48,7 +48,7 @@ static const struct blobmsg_policy get_device_descriptor_args[] = {
 };
 
 static int read_get_device_descriptor_response(
-	const void *response, struct blob_buf *bbuf)
+	const void *response, unsigned int length, struct blob_buf *bbuf)
 {
 	const struct device_descriptor *desc = response;
 
@@ -59,6 +59,11 @@ static int read_get_device_descriptor_response(
 			le16toh(desc->num_access_records));
 	blobmsg_add_u32(bbuf, "free_access_records",
 			le16toh(desc->free_access_records));
+	blobmsg_add_u32(bbuf, "acl_generation",
+			le16toh(desc->acl_generation));
+	blobmsg_add_u32(bbuf, "acl_hash", le16toh(desc->acl_hash));
+	blobmsg_add_u32(bbuf, "access_format", desc->access_format);
+	blobmsg_add_u32(bbuf, "max_payload_size", desc->max_payload_size);
 	return 0;
 }
 
@@ -71,7 +76,7 @@ static const struct blobmsg_policy get_door_config_args[] = {
 
 static int write_get_door_config_query(
 	struct blob_attr *const *const args,
-	void *query, struct blob_buf *bbuf)
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
 {
 	struct ctrl_cmd_get_door_config *cmd = query;
 
@@ -81,16 +86,18 @@ static int write_get_door_config_query(
 }
 
 static int read_get_door_config_response(
-	const void *response, struct blob_buf *bbuf)
+	const void *response, unsigned int length, struct blob_buf *bbuf)
 {
 	const struct door_config *cfg = (struct door_config *)response;
 
 	blobmsg_add_u32(bbuf, "open_time", le16toh(cfg->open_time));
+	blobmsg_add_u32(bbuf, "wiegand_formats", cfg->wiegand_formats);
 	return 0;
 }
 
 #define SET_DOOR_CONFIG_INDEX		0
 #define SET_DOOR_CONFIG_OPEN_TIME	1
+#define SET_DOOR_CONFIG_WIEGAND_FORMATS	2
 
 static const struct blobmsg_policy set_door_config_args[] = {
 	[SET_DOOR_CONFIG_INDEX] = {
@@ -101,11 +108,15 @@ static const struct blobmsg_policy set_door_config_args[] = {
 		.name = "open_time",
 		.type = BLOBMSG_TYPE_INT32,
 	},
+	[SET_DOOR_CONFIG_WIEGAND_FORMATS] = {
+		.name = "wiegand_formats",
+		.type = BLOBMSG_TYPE_INT32,
+	},
 };
 
 static int write_set_door_config_query(
 	struct blob_attr *const *const args,
-	void *query, struct blob_buf *bbuf)
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
 {
 	struct ctrl_cmd_set_door_config *cmd = query;
 
@@ -113,6 +124,11 @@ static int write_set_door_config_query(
 	cmd->index = blobmsg_get_u32(args[SET_DOOR_CONFIG_INDEX]);
 	cmd->config.open_time = htole16(
 		blobmsg_get_u32(args[SET_DOOR_CONFIG_OPEN_TIME]));
+	/* Use the default formats if none is given */
+	cmd->config.wiegand_formats = 0xFF;
+	if (args[SET_DOOR_CONFIG_WIEGAND_FORMATS])
+		cmd->config.wiegand_formats = blobmsg_get_u32(
+			args[SET_DOOR_CONFIG_WIEGAND_FORMATS]);
 
 	return 0;
 }
@@ -138,7 +154,7 @@ static const struct blobmsg_policy get_access_record_args[] = {
 
 static int write_get_access_record_query(
 	struct blob_attr *const *const args,
-	void *query, struct blob_buf *bbuf)
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
 {
 	struct ctrl_cmd_get_access_record *cmd = query;
 
@@ -160,13 +176,14 @@ static int write_get_access_record_query(
 	return 0;
 }
 
-static int read_get_access_record_response(
-	const void *response, struct blob_buf *bbuf)
+/* Add the fields of an access record, args are the get_access_record
+ * query arguments used to split card+pin records, they can be NULL. */
+static int add_access_record(struct blob_buf *bbuf,
+			     const struct access_record *rec,
+			     struct blob_attr *const *const args)
 {
-	const struct access_record *rec = (struct access_record *)response;
-	struct blob_attr *args[ARRAY_SIZE(get_access_record_args)] = {};
 	uint8_t perms, type, doors;
-	char *str_pin;
+	char *str_pin = NULL;
 	uint32_t key;
 	char pin[9];
 
@@ -193,17 +210,16 @@ static int read_get_access_record_response(
 		blobmsg_add_u32(bbuf, "card", key);
 		break;
 	case ACCESS_TYPE_CARD_AND_PIN:
-		blobmsg_parse(get_access_record_args,
-			      ARRAY_SIZE(get_access_record_args), args,
-			      blob_data(bbuf->head), blob_len(bbuf->head));
-		str_pin = blobmsg_get_string(args[GET_ACCESS_RECORD_PIN]);
+		if (args)
+			str_pin = blobmsg_get_string(
+				args[GET_ACCESS_RECORD_PIN]);
 		if (str_pin) {
 			uint32_t p;
 
 			if (pin_from_str(&p, str_pin))
 				return UBUS_STATUS_INVALID_ARGUMENT;
 			blobmsg_add_u32(bbuf, "card", key ^ p);
-		} else if (args[GET_ACCESS_RECORD_CARD]) {
+		} else if (args && args[GET_ACCESS_RECORD_CARD]) {
 			uint32_t card = blobmsg_get_u32(args[GET_ACCESS_RECORD_CARD]);
 
 			pin_to_str(key ^ card, pin);
@@ -217,6 +233,125 @@ static int read_get_access_record_response(
 	return 0;
 }
 
+static int read_get_access_record_response(
+	const void *response, unsigned int length, struct blob_buf *bbuf)
+{
+	const struct access_record *rec = (struct access_record *)response;
+	struct blob_attr *args[ARRAY_SIZE(get_access_record_args)] = {};
+
+	blobmsg_parse(get_access_record_args,
+		      ARRAY_SIZE(get_access_record_args), args,
+		      blob_data(bbuf->head), blob_len(bbuf->head));
+
+	return add_access_record(bbuf, rec, args);
+}
+
+#define GET_ACCESS_RECORDS_START	0
+#define GET_ACCESS_RECORDS_COUNT	1
+
+static const struct blobmsg_policy get_access_records_args[] = {
+	[GET_ACCESS_RECORDS_START] = {
+		.name = "start",
+		.type = BLOBMSG_TYPE_INT32,
+	},
+	[GET_ACCESS_RECORDS_COUNT] = {
+		.name = "count",
+		.type = BLOBMSG_TYPE_INT32,
+	},
+};
+
+static int write_get_access_records_query(
+	struct blob_attr *const *const args,
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
+{
+	struct ctrl_cmd_get_access_records *cmd = query;
+
+	cmd->start = htole16(
+		blobmsg_get_u32(args[GET_ACCESS_RECORDS_START]));
+	if (args[GET_ACCESS_RECORDS_COUNT])
+		cmd->count = blobmsg_get_u32(args[GET_ACCESS_RECORDS_COUNT]);
+
+	return 0;
+}
+
+static int read_get_access_records_response(
+	const void *response, unsigned int length, struct blob_buf *bbuf)
+{
+	const struct ctrl_cmd_access_records *recs = response;
+	unsigned int i, count = recs->count;
+	void *array, *table;
+	int err;
+
+	if (count > CTRL_CMD_GET_ACCESS_RECORDS_MAX ||
+	    length < sizeof(*recs) + count * sizeof(recs->entry[0]))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	blobmsg_add_u32(bbuf, "next", le16toh(recs->next));
+
+	array = blobmsg_open_array(bbuf, "records");
+	for (i = 0; i < count; i++) {
+		table = blobmsg_open_table(bbuf, NULL);
+		blobmsg_add_u32(bbuf, "index", le16toh(recs->entry[i].index));
+		err = add_access_record(bbuf, &recs->entry[i].record, NULL);
+		if (err)
+			return err;
+		blobmsg_close_table(bbuf, table);
+	}
+	blobmsg_close_array(bbuf, array);
+
+	return 0;
+}
+
+#define GET_ACCESS_BOOT_WRITE_COUNTS_START	0
+#define GET_ACCESS_BOOT_WRITE_COUNTS_COUNT	1
+
+static const struct blobmsg_policy get_access_boot_write_counts_args[] = {
+	[GET_ACCESS_BOOT_WRITE_COUNTS_START] = {
+		.name = "start",
+		.type = BLOBMSG_TYPE_INT32,
+	},
+	[GET_ACCESS_BOOT_WRITE_COUNTS_COUNT] = {
+		.name = "count",
+		.type = BLOBMSG_TYPE_INT32,
+	},
+};
+
+static int write_get_access_boot_write_counts_query(
+	struct blob_attr *const *const args,
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
+{
+	struct ctrl_cmd_get_access_boot_write_counts *cmd = query;
+
+	cmd->start = htole16(
+		blobmsg_get_u32(args[GET_ACCESS_BOOT_WRITE_COUNTS_START]));
+	if (args[GET_ACCESS_BOOT_WRITE_COUNTS_COUNT])
+		cmd->count = blobmsg_get_u32(
+			args[GET_ACCESS_BOOT_WRITE_COUNTS_COUNT]);
+
+	return 0;
+}
+
+static int read_get_access_boot_write_counts_response(
+	const void *response, unsigned int length, struct blob_buf *bbuf)
+{
+	const struct ctrl_cmd_access_boot_write_counts *wc = response;
+	unsigned int i, count = wc->count;
+	void *array;
+
+	if (count > CTRL_CMD_GET_ACCESS_BOOT_WRITE_COUNTS_MAX ||
+	    length < sizeof(*wc) + count * sizeof(wc->counts[0]))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	blobmsg_add_u32(bbuf, "start", le16toh(wc->start));
+
+	array = blobmsg_open_array(bbuf, "counts");
+	for (i = 0; i < count; i++)
+		blobmsg_add_u32(bbuf, NULL, wc->counts[i]);
+	blobmsg_close_array(bbuf, array);
+
+	return 0;
+}
+
 #define SET_ACCESS_RECORD_INDEX		0
 #define SET_ACCESS_RECORD_PIN		1
 #define SET_ACCESS_RECORD_CARD		2
@@ -248,7 +383,7 @@ static const struct blobmsg_policy set_access_record_args[] = {
 
 static int write_set_access_record_query(
 	struct blob_attr *const *const args,
-	void *query, struct blob_buf *bbuf)
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
 {
 	struct ctrl_cmd_set_access_record *cmd = query;
 	uint32_t card = 0, pin = 0;
@@ -302,6 +437,7 @@ static int write_set_access_record_query(
 #define SET_ACCESS_PIN		0
 #define SET_ACCESS_CARD		1
 #define SET_ACCESS_DOORS	2
+#define SET_ACCESS_CARD_N_PIN	3
 
 static const struct blobmsg_policy set_access_args[] = {
 	[SET_ACCESS_PIN] = {
@@ -316,13 +452,15 @@ static const struct blobmsg_policy set_access_args[] = {
 		.name = "doors",
 		.type = BLOBMSG_TYPE_INT32,
 	},
+	[SET_ACCESS_CARD_N_PIN] = {
+		.name = "card+pin",
+		.type = BLOBMSG_TYPE_INT32,
+	},
 };
 
-static int write_set_access_query(
-	struct blob_attr *const *const args,
-	void *query, struct blob_buf *bbuf)
+static int access_record_from_args(
+	struct blob_attr *const *const args, struct access_record *rec)
 {
-	struct access_record *rec = query;
 	uint32_t card = 0, pin = 0;
 	uint8_t doors = 0;
 	char *str_pin;
@@ -331,10 +469,15 @@ static int write_set_access_query(
 	str_pin = blobmsg_get_string(args[SET_ACCESS_PIN]);
 	if (args[SET_ACCESS_CARD])
 		card = blobmsg_get_u32(args[SET_ACCESS_CARD]);
+	if (args[SET_ACCESS_CARD_N_PIN])
+		card = blobmsg_get_u32(args[SET_ACCESS_CARD_N_PIN]);
 	if (args[SET_ACCESS_DOORS])
 		doors = blobmsg_get_u32(args[SET_ACCESS_DOORS]) & 0xF;
 
-	if (args[SET_ACCESS_CARD] && str_pin)
+	/* Raw keys, as read back from the controller */
+	if (args[SET_ACCESS_CARD_N_PIN])
+		type = ACCESS_TYPE_CARD_AND_PIN;
+	else if (args[SET_ACCESS_CARD] && str_pin)
 		type = ACCESS_TYPE_CARD_AND_PIN;
 	else if (args[SET_ACCESS_CARD])
 		type = ACCESS_TYPE_CARD;
@@ -345,6 +488,8 @@ static int write_set_access_query(
 
 	switch (type) {
 	case ACCESS_TYPE_CARD_AND_PIN:
+		if (args[SET_ACCESS_CARD_N_PIN])
+			break;
 	case ACCESS_TYPE_PIN:
 		if (pin_from_str(&pin, str_pin))
 			return UBUS_STATUS_INVALID_ARGUMENT;
@@ -357,9 +502,217 @@ static int write_set_access_query(
 	return 0;
 }
 
+static int write_set_access_query(
+	struct blob_attr *const *const args,
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
+{
+	return access_record_from_args(args, query);
+}
+
+static const struct blobmsg_policy set_access_batch_args[] = {
+	{
+		.name = "records",
+		.type = BLOBMSG_TYPE_ARRAY,
+	},
+};
+
+static int write_set_access_batch_query(
+	struct blob_attr *const *const args,
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
+{
+	struct blob_attr *rec_args[ARRAY_SIZE(set_access_args)];
+	struct access_record *rec = query;
+	struct blob_attr *cur;
+	unsigned int count = 0;
+	int rem, err;
+
+	blobmsg_for_each_attr(cur, args[0], rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE ||
+		    count >= CTRL_CMD_SET_ACCESS_BATCH_MAX)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+
+		blobmsg_parse(set_access_args, ARRAY_SIZE(set_access_args),
+			      rec_args, blobmsg_data(cur),
+			      blobmsg_data_len(cur));
+		err = access_record_from_args(rec_args, &rec[count]);
+		if (err)
+			return err;
+		count++;
+	}
+
+	if (count == 0)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	*query_size = count * sizeof(*rec);
+	return 0;
+}
+
+static int read_set_access_batch_response(
+	const void *response, unsigned int length, struct blob_buf *bbuf)
+{
+	const struct ctrl_cmd_set_access_batch_status *status = response;
+
+	blobmsg_add_u32(bbuf, "failed", le16toh(status->failed));
+	return 0;
+}
+
 static const struct blobmsg_policy remove_all_access_args[] = {
 };
 
+static const struct blobmsg_policy get_event_stats_args[] = {
+};
+
+static int read_get_event_stats_response(
+	const void *response, unsigned int length, struct blob_buf *bbuf)
+{
+	const struct ctrl_cmd_event_stats *es = response;
+	unsigned int i, num_sources = es->num_sources;
+	void *array, *table;
+
+	if (num_sources > CTRL_CMD_EVENT_STATS_MAX_SOURCES ||
+	    length < sizeof(*es) + num_sources * sizeof(es->source[0]))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	blobmsg_add_u32(bbuf, "events", le16toh(es->events));
+	blobmsg_add_u32(bbuf, "drops", le16toh(es->drops));
+	blobmsg_add_u32(bbuf, "depth", es->depth);
+	blobmsg_add_u32(bbuf, "max_depth", es->max_depth);
+	blobmsg_add_u32(bbuf, "queue_size", es->queue_size);
+
+	array = blobmsg_open_array(bbuf, "sources");
+	for (i = 0; i < num_sources; i++) {
+		table = blobmsg_open_table(bbuf, NULL);
+		blobmsg_add_u32(bbuf, "source", es->source[i].source);
+		blobmsg_add_u32(bbuf, "events", le16toh(es->source[i].events));
+		blobmsg_add_u32(bbuf, "drops", le16toh(es->source[i].drops));
+		blobmsg_close_table(bbuf, table);
+	}
+	blobmsg_close_array(bbuf, array);
+
+	return 0;
+}
+
+static const struct blobmsg_policy get_timer_stats_args[] = {
+	{
+		.name = "reset",
+		.type = BLOBMSG_TYPE_BOOL,
+	},
+};
+
+static int write_get_timer_stats_query(
+	struct blob_attr *const *const args,
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
+{
+	struct ctrl_cmd_get_timer_stats *cmd = query;
+
+	if (args[0])
+		cmd->reset = blobmsg_get_bool(args[0]);
+	return 0;
+}
+
+static int read_get_timer_stats_response(
+	const void *response, unsigned int length, struct blob_buf *bbuf)
+{
+	const struct ctrl_cmd_timer_stats *ts = response;
+	unsigned int i;
+	void *array;
+
+	array = blobmsg_open_array(bbuf, "lateness");
+	for (i = 0; i < ARRAY_SIZE(ts->lateness); i++)
+		blobmsg_add_u32(bbuf, NULL, le16toh(ts->lateness[i]));
+	blobmsg_close_array(bbuf, array);
+
+	blobmsg_add_u32(bbuf, "max_lateness", le16toh(ts->max_lateness));
+	blobmsg_add_u32(bbuf, "max_isr", le16toh(ts->max_isr));
+	blobmsg_add_u32(bbuf, "max_callback", le16toh(ts->max_callback));
+	blobmsg_add_u32(bbuf, "max_pending", ts->max_pending);
+	blobmsg_add_u32(bbuf, "max_timers", ts->max_timers);
+
+	return 0;
+}
+
+#define GET_READER_STATS_INDEX		0
+#define GET_READER_STATS_RESET		1
+
+static const struct blobmsg_policy get_reader_stats_args[] = {
+	[GET_READER_STATS_INDEX] = {
+		.name = "index",
+		.type = BLOBMSG_TYPE_INT32,
+	},
+	[GET_READER_STATS_RESET] = {
+		.name = "reset",
+		.type = BLOBMSG_TYPE_BOOL,
+	},
+};
+
+static int write_get_reader_stats_query(
+	struct blob_attr *const *const args,
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
+{
+	struct ctrl_cmd_get_reader_stats *cmd = query;
+
+	blobmsg_add_u32(bbuf, "index",
+			blobmsg_get_u32(args[GET_READER_STATS_INDEX]));
+	cmd->index = blobmsg_get_u32(args[GET_READER_STATS_INDEX]);
+	if (args[GET_READER_STATS_RESET])
+		cmd->reset = blobmsg_get_bool(args[GET_READER_STATS_RESET]);
+	return 0;
+}
+
+static int read_get_reader_stats_response(
+	const void *response, unsigned int length, struct blob_buf *bbuf)
+{
+	static const char * const words_names[] = {
+		"key4", "key8", "h10301", "h10306", "c1000_35", "h10304",
+		"other",
+	};
+	const struct ctrl_cmd_reader_stats *rs = response;
+	unsigned int i;
+	void *table;
+
+	_Static_assert(ARRAY_SIZE(words_names) ==
+		       CTRL_CMD_READER_STATS_WORD_LENGTHS,
+		       "Reader stats word lengths mismatch");
+
+	table = blobmsg_open_table(bbuf, "words");
+	for (i = 0; i < ARRAY_SIZE(rs->words); i++)
+		blobmsg_add_u32(bbuf, words_names[i], le16toh(rs->words[i]));
+	blobmsg_close_table(bbuf, table);
+
+	blobmsg_add_u32(bbuf, "parity_errors", le16toh(rs->parity_errors));
+	blobmsg_add_u32(bbuf, "unsupported", le16toh(rs->unsupported));
+	blobmsg_add_u32(bbuf, "pulse_errors", le16toh(rs->pulse_errors));
+	blobmsg_add_u32(bbuf, "overflows", le16toh(rs->overflows));
+	blobmsg_add_u32(bbuf, "ring_overflows", le16toh(rs->ring_overflows));
+	blobmsg_add_u32(bbuf, "disconnects", le16toh(rs->disconnects));
+	if (rs->last_error) {
+		blobmsg_add_u32(bbuf, "last_error", -rs->last_error);
+		/* The device time, so give the age of the error */
+		blobmsg_add_u32(bbuf, "last_error_age",
+				le32toh(rs->time) -
+				le32toh(rs->last_error_time));
+	}
+
+	return 0;
+}
+
+static const struct blobmsg_policy set_access_format_args[] = {
+	{
+		.name = "format",
+		.type = BLOBMSG_TYPE_INT32,
+	},
+};
+
+static int write_set_access_format_query(
+	struct blob_attr *const *const args,
+	void *query, unsigned int *query_size, struct blob_buf *bbuf)
+{
+	struct ctrl_cmd_set_access_format *cmd = query;
+
+	cmd->format = blobmsg_get_u32(args[0]);
+	return 0;
+}
+
 #define AVR_DOOR_CTRL_METHOD(method, opt_args, cmd_id,			\
 			     wr_query, qr_size, rd_resp, resp_size)	\
 	{								\
@@ -391,7 +744,7 @@ const struct avr_door_ctrl_method avr_door_ctrl_methods[] = {
 		sizeof(struct door_config)),
 
 	AVR_DOOR_CTRL_METHOD(
-		set_door_config, 0,
+		set_door_config, BIT(SET_DOOR_CONFIG_WIEGAND_FORMATS),
 		CTRL_CMD_SET_DOOR_CONFIG,
 		write_set_door_config_query,
 		sizeof(struct ctrl_cmd_set_door_config),
@@ -407,6 +760,24 @@ const struct avr_door_ctrl_method avr_door_ctrl_methods[] = {
 		read_get_access_record_response,
 		sizeof(struct access_record)),
 
+	AVR_DOOR_CTRL_METHOD(
+		get_access_records,
+		BIT(GET_ACCESS_RECORDS_COUNT),
+		CTRL_CMD_GET_ACCESS_RECORDS,
+		write_get_access_records_query,
+		sizeof(struct ctrl_cmd_get_access_records),
+		read_get_access_records_response,
+		sizeof(struct ctrl_cmd_access_records)),
+
+	AVR_DOOR_CTRL_METHOD(
+		get_access_boot_write_counts,
+		BIT(GET_ACCESS_BOOT_WRITE_COUNTS_COUNT),
+		CTRL_CMD_GET_ACCESS_BOOT_WRITE_COUNTS,
+		write_get_access_boot_write_counts_query,
+		sizeof(struct ctrl_cmd_get_access_boot_write_counts),
+		read_get_access_boot_write_counts_response,
+		sizeof(struct ctrl_cmd_access_boot_write_counts)),
+
 	AVR_DOOR_CTRL_METHOD(
 		set_access_record,
 		BIT(SET_ACCESS_RECORD_PIN) |
@@ -422,7 +793,8 @@ const struct avr_door_ctrl_method avr_door_ctrl_methods[] = {
 		set_access,
 		BIT(SET_ACCESS_PIN) |
 		BIT(SET_ACCESS_CARD) |
-		BIT(SET_ACCESS_DOORS),
+		BIT(SET_ACCESS_DOORS) |
+		BIT(SET_ACCESS_CARD_N_PIN),
 		CTRL_CMD_SET_ACCESS,
 		write_set_access_query,
 		sizeof(struct access_record),
@@ -432,6 +804,43 @@ const struct avr_door_ctrl_method avr_door_ctrl_methods[] = {
 		remove_all_access, 0,
 		CTRL_CMD_REMOVE_ALL_ACCESS,
 		NULL, 0, NULL, 0),
+
+	AVR_DOOR_CTRL_METHOD(
+		set_access_batch, 0,
+		CTRL_CMD_SET_ACCESS_BATCH,
+		write_set_access_batch_query, 0,
+		read_set_access_batch_response,
+		sizeof(struct ctrl_cmd_set_access_batch_status)),
+
+	AVR_DOOR_CTRL_METHOD(
+		get_event_stats, 0,
+		CTRL_CMD_GET_EVENT_STATS,
+		NULL, 0,
+		read_get_event_stats_response,
+		sizeof(struct ctrl_cmd_event_stats)),
+
+	AVR_DOOR_CTRL_METHOD(
+		get_timer_stats, BIT(0),
+		CTRL_CMD_GET_TIMER_STATS,
+		write_get_timer_stats_query,
+		sizeof(struct ctrl_cmd_get_timer_stats),
+		read_get_timer_stats_response,
+		sizeof(struct ctrl_cmd_timer_stats)),
+
+	AVR_DOOR_CTRL_METHOD(
+		get_reader_stats, BIT(GET_READER_STATS_RESET),
+		CTRL_CMD_GET_READER_STATS,
+		write_get_reader_stats_query,
+		sizeof(struct ctrl_cmd_get_reader_stats),
+		read_get_reader_stats_response,
+		sizeof(struct ctrl_cmd_reader_stats)),
+
+	AVR_DOOR_CTRL_METHOD(
+		set_access_format, 0,
+		CTRL_CMD_SET_ACCESS_FORMAT,
+		write_set_access_format_query,
+		sizeof(struct ctrl_cmd_set_access_format),
+		NULL, 0),
 };
 
 const struct avr_door_ctrl_method *avr_door_ctrl_get_method(const char *name)
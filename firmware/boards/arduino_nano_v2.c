@@ -10,6 +10,7 @@ const struct door_ctrl_config doors_config[] PROGMEM = {
 		.d1_irq = IRQ(PC, 3),
 		.open_gpio = GPIO(C, 0, HIGH_ACTIVE),
 		.open_time = 4000,
+		.wiegand_formats = WIEGAND_FORMATS_DEFAULT,
 		.led_gpio = GPIO(B, 1, LOW_ACTIVE),
 		.buzzer_gpio = GPIO(B, 0, LOW_ACTIVE),
 		.status_gpio = GPIO(B, 2, LOW_ACTIVE),
@@ -23,6 +24,7 @@ const struct door_ctrl_config doors_config[] PROGMEM = {
 		.d1_irq = IRQ(PC, 21),
 		.open_gpio = GPIO(C, 2, HIGH_ACTIVE),
 		.open_time = 4000,
+		.wiegand_formats = WIEGAND_FORMATS_DEFAULT,
 		.led_gpio = GPIO(D, 3, LOW_ACTIVE),
 		.buzzer_gpio = GPIO(D, 2, LOW_ACTIVE),
 		.status_gpio = GPIO(D, 4, LOW_ACTIVE),
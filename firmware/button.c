@@ -55,7 +55,7 @@ int8_t button_init(struct button *btn, uint8_t gpio,
 	btn->callback = callback;
 	btn->context = context;
 
-	timer_init(&btn->debounce, button_timeout, btn);
+	timer_init(&btn->debounce, button_timeout, btn, 0);
 	btn->debounce_delay = debounce_delay;
 
 	err = external_irq_setup(
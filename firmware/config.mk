@@ -26,3 +26,6 @@ MCU_O := $(patsubst %.c,%.o,$(wildcard mcu/$(MCU).c))
 ifeq ($(wildcard $(MCU_H)),)
 $(error $(MCU) is not a supported MCU)
 endif
+
+# Get the RAM size from $(MCU_H)
+RAM_SIZE := $(shell echo RAM_SIZE | $(CPP) -E -P -imacros $(MCU_H) -)
@@ -5,7 +5,11 @@
 #include "eeprom-types.h"
 
 #define CTRL_MSG_HEADER_SIZE		2
-#define CTRL_MSG_MAX_PAYLOAD_SIZE	16
+/* The MCU config can lower it to save RAM, the host get the actual
+ * size from the device descriptor. */
+#ifndef CTRL_MSG_MAX_PAYLOAD_SIZE
+#define CTRL_MSG_MAX_PAYLOAD_SIZE	48
+#endif
 
 struct ctrl_msg {
 	uint8_t type;
@@ -45,6 +49,10 @@ struct ctrl_msg {
 
 /* Input:  none
  * Output: none
+ *
+ * The removed records are invalidated in the background, which takes
+ * up to 0.9 s. Fails with -EBUSY if this is still running from the
+ * last call.
  */
 #define CTRL_CMD_REMOVE_ALL_ACCESS	23
 
@@ -53,6 +61,79 @@ struct ctrl_msg {
  */
 #define CTRL_CMD_GET_ACCESS		24
 
+/* Input:  struct access_record[] (1 to CTRL_CMD_SET_ACCESS_BATCH_MAX)
+ * Output: struct ctrl_cmd_set_access_batch_status
+ */
+#define CTRL_CMD_SET_ACCESS_BATCH	25
+
+#define CTRL_CMD_SET_ACCESS_BATCH_MAX \
+	(CTRL_MSG_MAX_PAYLOAD_SIZE / sizeof(struct access_record))
+
+/* Input:  struct ctrl_cmd_get_access_records
+ * Output: struct ctrl_cmd_access_records
+ *
+ * Return the used records starting at index start, up to count
+ * records or as many as fit in a message if count is 0.
+ */
+#define CTRL_CMD_GET_ACCESS_RECORDS	26
+
+#define CTRL_CMD_GET_ACCESS_RECORDS_MAX \
+	((CTRL_MSG_MAX_PAYLOAD_SIZE - sizeof(struct ctrl_cmd_access_records)) / \
+	 sizeof(struct ctrl_cmd_access_records_entry))
+
+/* Input:  struct ctrl_cmd_set_access_format
+ * Output: none
+ *
+ * Switch the access records to another format, this erase all the
+ * records. Changing to the current format does nothing.
+ */
+#define CTRL_CMD_SET_ACCESS_FORMAT	27
+
+/* Input:  struct ctrl_cmd_get_access_boot_write_counts
+ * Output: struct ctrl_cmd_access_boot_write_counts
+ *
+ * Return the number of writes to each record since boot, starting at
+ * index start, up to count records or as many as fit in a message if
+ * count is 0. The counts saturate at 255. They are only kept in RAM,
+ * so they restart from 0 on each boot and don't show the total wear
+ * of the EEPROM. Fails with -ENOSYS if the firmware has been built
+ * without the write counts.
+ */
+#define CTRL_CMD_GET_ACCESS_BOOT_WRITE_COUNTS	28
+
+#define CTRL_CMD_GET_ACCESS_BOOT_WRITE_COUNTS_MAX \
+	(CTRL_MSG_MAX_PAYLOAD_SIZE - \
+	 sizeof(struct ctrl_cmd_access_boot_write_counts))
+
+/* Input:  none
+ * Output: struct ctrl_cmd_event_stats
+ *
+ * Fails with -ENOSYS if the firmware has been built without the
+ * event statistics.
+ */
+#define CTRL_CMD_GET_EVENT_STATS	29
+
+#define CTRL_CMD_EVENT_STATS_MAX_SOURCES \
+	((CTRL_MSG_MAX_PAYLOAD_SIZE - sizeof(struct ctrl_cmd_event_stats)) / \
+	 sizeof(struct ctrl_cmd_event_source_stats))
+
+/* Input:  struct ctrl_cmd_get_timer_stats
+ * Output: struct ctrl_cmd_timer_stats
+ *
+ * Only available if the firmware has been built with TIMER_STATS=1,
+ * otherwise fails with -ENOSYS. If reset is set the statistics are
+ * cleared after being read.
+ */
+#define CTRL_CMD_GET_TIMER_STATS	30
+
+/* Input:  struct ctrl_cmd_get_reader_stats
+ * Output: struct ctrl_cmd_reader_stats
+ *
+ * The index is the door index. If reset is set the statistics
+ * are cleared after being read. Fails with -ENOSYS if the firmware
+ * has been built without the reader statistics.
+ */
+#define CTRL_CMD_GET_READER_STATS	31
 
 /* Payload depend on the query */
 #define CTRL_CMD_OK			0
@@ -72,6 +153,22 @@ struct device_descriptor {
 	uint8_t num_doors;
 	uint16_t num_access_records;
 	uint16_t free_access_records;
+
+	/* Change each time the ACL is modified */
+	uint16_t acl_generation;
+	/* Sum modulo 2^16 of a digest of all the used access records.
+	 * The digest is the xmodem CRC of the record in the same format
+	 * as the SET_ACCESS input, mixed with:
+	 *   h ^= h >> 8; h *= 0x88B5; h ^= h >> 7; h *= 0xDB2D; h ^= h >> 9;
+	 */
+	uint16_t acl_hash;
+
+	/* Format of the access records, ACCESS_FORMAT_* */
+	uint8_t access_format;
+
+	/* Largest payload the device accept, the batch commands must
+	 * be sized against it */
+	uint8_t max_payload_size;
 } PACKED;
 
 struct ctrl_cmd_get_door_config {
@@ -92,4 +189,103 @@ struct ctrl_cmd_set_access_record {
 	struct access_record record;
 } PACKED;
 
+struct ctrl_cmd_get_access_records {
+	uint16_t start;
+	uint8_t count;
+} PACKED;
+
+struct ctrl_cmd_access_records_entry {
+	uint16_t index;
+	struct access_record record;
+} PACKED;
+
+struct ctrl_cmd_access_records {
+	/* Index to continue from, num_access_records at the end */
+	uint16_t next;
+	uint8_t count;
+	struct ctrl_cmd_access_records_entry entry[];
+} PACKED;
+
+struct ctrl_cmd_set_access_format {
+	uint8_t format;
+} PACKED;
+
+struct ctrl_cmd_get_access_boot_write_counts {
+	uint16_t start;
+	uint8_t count;
+} PACKED;
+
+struct ctrl_cmd_access_boot_write_counts {
+	uint16_t start;
+	uint8_t count;
+	uint8_t counts[];
+} PACKED;
+
+struct ctrl_cmd_event_source_stats {
+	/* 0 for the timers, 1 for the EEPROM, 2 for the control transport,
+	 * 3 + n for the reader of door n and 3 + the number of doors for
+	 * the Wiegand pulses. */
+	uint8_t source;
+	uint16_t events;
+	uint16_t drops;
+} PACKED;
+
+/* All the counters wrap around */
+struct ctrl_cmd_event_stats {
+	uint16_t events;
+	uint16_t drops;
+	uint8_t depth;
+	uint8_t max_depth;
+	uint8_t queue_size;
+	uint8_t num_sources;
+	struct ctrl_cmd_event_source_stats source[];
+} PACKED;
+
+struct ctrl_cmd_get_timer_stats {
+	uint8_t reset;
+} PACKED;
+
+#define CTRL_CMD_TIMER_STATS_LATENESS_BUCKETS	8
+
+/* All the durations are in microseconds */
+struct ctrl_cmd_timer_stats {
+	/* Bucket n counts the callbacks that ran less than (128 << n) us
+	 * late, the last bucket all the others. The counts saturate. */
+	uint16_t lateness[CTRL_CMD_TIMER_STATS_LATENESS_BUCKETS];
+	uint16_t max_lateness;
+	uint16_t max_isr;
+	uint16_t max_callback;
+	uint8_t max_pending;
+	uint8_t max_timers;
+} PACKED;
+
+struct ctrl_cmd_get_reader_stats {
+	uint8_t index;
+	uint8_t reset;
+} PACKED;
+
+/* Words of 4 and 8 bits, of each card format and of other lengths */
+#define CTRL_CMD_READER_STATS_WORD_LENGTHS	7
+
+/* All the counters saturate */
+struct ctrl_cmd_reader_stats {
+	uint16_t words[CTRL_CMD_READER_STATS_WORD_LENGTHS];
+	uint16_t parity_errors;
+	uint16_t unsupported;
+	uint16_t pulse_errors;
+	uint16_t overflows;
+	uint16_t ring_overflows;
+	uint16_t disconnects;
+	/* Time of the last error and current time in milliseconds. The
+	 * time doesn't run while the device sleeps without timers. */
+	uint32_t last_error_time;
+	uint32_t time;
+	int8_t last_error;
+} PACKED;
+
+struct ctrl_cmd_set_access_batch_status {
+	/* Bitmask of the records that couldn't be set */
+	uint16_t failed;
+} PACKED;
+
 #endif /* CTRL_CMD_TYPES_H */
@@ -1,28 +1,64 @@
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #include "uart.h"
 #include "uart-ctrl-transport.h"
 #include "ctrl-cmd.h"
 #include "eeprom.h"
 #include "event-queue.h"
+#include "timer.h"
+#include "wiegand-reader.h"
 #include "utils.h"
 
 struct ctrl_cmd_desc {
 	uint8_t type;
 	uint8_t length;
-	int8_t (*handler)(struct ctrl_transport *ctrl, const void *payload);
+	/* If set the command is followed by a list of such entries */
+	uint8_t entry_size;
+	int8_t (*handler)(struct ctrl_transport *ctrl,
+			  const void *payload, uint8_t length);
 };
 
+/* Sequence number of the EEPROM write to wait for before replying */
+static uint8_t reply_write_seq;
+static uint8_t reply_pending;
+
+/* Reply payload to send once the writes are done */
+static uint8_t reply_payload[2];
+static uint8_t reply_length;
+
+/* Send the OK reply once all the queued EEPROM writes are done */
+static int8_t ctrl_cmd_reply_when_written(struct ctrl_transport *ctrl,
+					  const void *payload, uint8_t length)
+{
+	reply_write_seq = eeprom_write_seq();
+	if (eeprom_write_done(reply_write_seq))
+		return ctrl_transport_reply(ctrl, CTRL_CMD_OK,
+					    payload, length);
+
+	if (length > sizeof(reply_payload))
+		return -E2BIG;
+
+	memcpy(reply_payload, payload, length);
+	reply_length = length;
+	reply_pending = 1;
+	return 0;
+}
+
 static int8_t ctrl_cmd_get_device_descriptor(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
 	struct device_descriptor desc = {
 		.major_version = 0,
-		.minor_version = 1,
+		.minor_version = 11,
 		.num_doors = NUM_DOORS,
-		.num_access_records = NUM_ACCESS_RECORDS,
+		.num_access_records = eeprom_get_access_record_count(),
 		.free_access_records = eeprom_get_free_access_record_count(),
+		.acl_generation = eeprom_get_acl_generation(),
+		.acl_hash = eeprom_get_acl_hash(),
+		.access_format = eeprom_get_access_format(),
+		.max_payload_size = CTRL_MSG_MAX_PAYLOAD_SIZE,
 	};
 
 	return ctrl_transport_reply(ctrl, CTRL_CMD_OK,
@@ -30,7 +66,7 @@ static int8_t ctrl_cmd_get_device_descriptor(
 }
 
 static int8_t ctrl_cmd_get_door_config(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
 	const struct ctrl_cmd_get_door_config *get = payload;
 	struct door_config cfg;
@@ -45,7 +81,7 @@ static int8_t ctrl_cmd_get_door_config(
 }
 
 static int8_t ctrl_cmd_set_door_config(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
 	const struct ctrl_cmd_set_door_config *set = payload;
 	int8_t err;
@@ -54,11 +90,11 @@ static int8_t ctrl_cmd_set_door_config(
 	if (err)
 		return err;
 
-	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, NULL, 0);
+	return ctrl_cmd_reply_when_written(ctrl, NULL, 0);
 }
 
 static int8_t ctrl_cmd_get_access_record(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
 	const struct ctrl_cmd_get_access_record *get = payload;
 	struct access_record record;
@@ -72,8 +108,37 @@ static int8_t ctrl_cmd_get_access_record(
 				    &record, sizeof(record));
 }
 
+static int8_t ctrl_cmd_get_access_records(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	const struct ctrl_cmd_get_access_records *get = payload;
+	uint8_t buffer[CTRL_MSG_MAX_PAYLOAD_SIZE];
+	struct ctrl_cmd_access_records *recs = (void *)buffer;
+	uint8_t count = get->count;
+	uint16_t index = get->start;
+
+	if (count == 0 || count > CTRL_CMD_GET_ACCESS_RECORDS_MAX)
+		count = CTRL_CMD_GET_ACCESS_RECORDS_MAX;
+
+	for (recs->count = 0; recs->count < count; recs->count++) {
+		struct ctrl_cmd_access_records_entry *e =
+			&recs->entry[recs->count];
+		struct access_record rec;
+
+		if (eeprom_get_next_access_record(&index, &rec))
+			break;
+		e->index = index++;
+		e->record = rec;
+	}
+	recs->next = index;
+
+	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, recs,
+				    sizeof(*recs) +
+				    recs->count * sizeof(*recs->entry));
+}
+
 static int8_t ctrl_cmd_set_access_record(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
 	const struct ctrl_cmd_set_access_record *set = payload;
 	int8_t err;
@@ -82,11 +147,11 @@ static int8_t ctrl_cmd_set_access_record(
 	if (err)
 		return err;
 
-	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, NULL, 0);
+	return ctrl_cmd_reply_when_written(ctrl, NULL, 0);
 }
 
 static int8_t ctrl_cmd_set_access(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
 	const struct access_record *record = payload;
 	int8_t err;
@@ -95,11 +160,11 @@ static int8_t ctrl_cmd_set_access(
 	if (err)
 		return err;
 
-	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, NULL, 0);
+	return ctrl_cmd_reply_when_written(ctrl, NULL, 0);
 }
 
 static int8_t ctrl_cmd_get_access(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
 	const struct access_record *record = payload;
 	uint8_t doors;
@@ -112,13 +177,195 @@ static int8_t ctrl_cmd_get_access(
 	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, &doors, sizeof(doors));
 }
 
+static int8_t ctrl_cmd_set_access_batch(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	const struct access_record *record = payload;
+	struct ctrl_cmd_set_access_batch_status status = {};
+	uint8_t i;
+
+	for (i = 0; i < length / sizeof(*record); i++)
+		if (eeprom_set_access(record[i].type, record[i].key,
+				      record[i].doors))
+			status.failed |= BIT(i);
+
+	return ctrl_cmd_reply_when_written(ctrl, &status, sizeof(status));
+}
+
 static int8_t ctrl_cmd_remove_all_access(
-	struct ctrl_transport *ctrl, const void *payload)
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	int8_t err;
+
+	err = eeprom_remove_all_access();
+	if (err)
+		return err;
+
+	return ctrl_cmd_reply_when_written(ctrl, NULL, 0);
+}
+
+static int8_t ctrl_cmd_set_access_format(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	const struct ctrl_cmd_set_access_format *set = payload;
+	int8_t err;
+
+	err = eeprom_set_access_format(set->format);
+	if (err)
+		return err;
+
+	return ctrl_cmd_reply_when_written(ctrl, NULL, 0);
+}
+
+#if ACCESS_BOOT_WRITE_COUNTS
+static int8_t ctrl_cmd_get_access_boot_write_counts(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	const struct ctrl_cmd_get_access_boot_write_counts *get = payload;
+	uint8_t buffer[CTRL_MSG_MAX_PAYLOAD_SIZE];
+	struct ctrl_cmd_access_boot_write_counts *wc = (void *)buffer;
+	uint16_t num = eeprom_get_access_record_count();
+	uint16_t start = get->start;
+	uint8_t count = get->count;
+
+	if (start > num)
+		return -EINVAL;
+
+	if (count == 0 || count > CTRL_CMD_GET_ACCESS_BOOT_WRITE_COUNTS_MAX)
+		count = CTRL_CMD_GET_ACCESS_BOOT_WRITE_COUNTS_MAX;
+	if (count > num - start)
+		count = num - start;
+
+	wc->start = start;
+	for (wc->count = 0; wc->count < count; wc->count++)
+		wc->counts[wc->count] =
+			eeprom_get_access_boot_write_count(start + wc->count);
+
+	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, wc,
+				    sizeof(*wc) + wc->count);
+}
+#else
+static int8_t ctrl_cmd_get_access_boot_write_counts(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	return -ENOSYS;
+}
+#endif
+
+#if EVENT_STATS
+static int8_t ctrl_cmd_get_event_stats(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	uint8_t buffer[CTRL_MSG_MAX_PAYLOAD_SIZE];
+	struct ctrl_cmd_event_stats *es = (void *)buffer;
+	struct event_queue_stats stats;
+	uint8_t i;
+
+	event_get_stats(&stats);
+
+	es->events = stats.events;
+	es->drops = stats.drops;
+	es->depth = stats.depth;
+	es->max_depth = stats.max_depth;
+	es->queue_size = MAX_PENDING_EVENTS;
+	/* Only report the first sources if they don't all fit */
+	es->num_sources = EVENT_STATS_MAX_SOURCES;
+	if (es->num_sources > CTRL_CMD_EVENT_STATS_MAX_SOURCES)
+		es->num_sources = CTRL_CMD_EVENT_STATS_MAX_SOURCES;
+	for (i = 0; i < es->num_sources; i++) {
+		es->source[i].source = i;
+		es->source[i].events = stats.source[i].events;
+		es->source[i].drops = stats.source[i].drops;
+	}
+
+	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, es, sizeof(*es) +
+				    es->num_sources * sizeof(*es->source));
+}
+#else
+static int8_t ctrl_cmd_get_event_stats(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	return -ENOSYS;
+}
+#endif
+
+#if TIMER_STATS
+static int8_t ctrl_cmd_get_timer_stats(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
 {
-	eeprom_remove_all_access();
+	const struct ctrl_cmd_get_timer_stats *cmd = payload;
+	struct ctrl_cmd_timer_stats ts;
+	struct timer_stats stats;
+	uint8_t i;
+	int8_t err;
+
+	_Static_assert(CTRL_CMD_TIMER_STATS_LATENESS_BUCKETS ==
+		       TIMER_STATS_LATENESS_BUCKETS,
+		       "Timer stats buckets mismatch");
+
+	err = timer_get_stats(&stats, cmd->reset);
+	if (err)
+		return err;
+
+	for (i = 0; i < ARRAY_SIZE(ts.lateness); i++)
+		ts.lateness[i] = stats.lateness[i];
+	ts.max_lateness = stats.max_lateness;
+	ts.max_isr = stats.max_isr;
+	ts.max_callback = stats.max_callback;
+	ts.max_pending = stats.max_pending;
+	ts.max_timers = MAX_TIMERS;
+
+	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, &ts, sizeof(ts));
+}
+#else
+static int8_t ctrl_cmd_get_timer_stats(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	return -ENOSYS;
+}
+#endif
+
+#if WIEGAND_READER_STATS
+static int8_t ctrl_cmd_get_reader_stats(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	const struct ctrl_cmd_get_reader_stats *cmd = payload;
+	struct ctrl_cmd_reader_stats rs;
+	struct wiegand_reader_stats stats;
+	uint8_t i;
+	int8_t err;
+
+	_Static_assert(CTRL_CMD_READER_STATS_WORD_LENGTHS ==
+		       WIEGAND_STATS_WORDS_LENGTHS,
+		       "Reader stats word lengths mismatch");
+	_Static_assert(sizeof(rs) <= CTRL_MSG_MAX_PAYLOAD_SIZE,
+		       "Reader stats don't fit in a message");
+
+	err = wiegand_reader_get_stats(cmd->index, &stats, cmd->reset);
+	if (err)
+		return err;
 
-	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, NULL, 0);
+	for (i = 0; i < ARRAY_SIZE(rs.words); i++)
+		rs.words[i] = stats.words[i];
+	rs.parity_errors = stats.parity_errors;
+	rs.unsupported = stats.unsupported;
+	rs.pulse_errors = stats.pulse_errors;
+	rs.overflows = stats.overflows;
+	rs.ring_overflows = stats.ring_overflows;
+	rs.disconnects = stats.disconnects;
+	rs.last_error_time = stats.last_error_time;
+	rs.time = timer_get_time();
+	rs.last_error = stats.last_error;
+
+	return ctrl_transport_reply(ctrl, CTRL_CMD_OK, &rs, sizeof(rs));
+}
+#else
+static int8_t ctrl_cmd_get_reader_stats(
+	struct ctrl_transport *ctrl, const void *payload, uint8_t length)
+{
+	return -ENOSYS;
 }
+#endif
 
 static const struct ctrl_cmd_desc ctrl_cmd_desc[] PROGMEM = {
 	{
@@ -161,6 +408,42 @@ static const struct ctrl_cmd_desc ctrl_cmd_desc[] PROGMEM = {
 		.length  = 0,
 		.handler = ctrl_cmd_remove_all_access,
 	},
+	{
+		.type    = CTRL_CMD_GET_ACCESS_RECORDS,
+		.length  = sizeof(struct ctrl_cmd_get_access_records),
+		.handler = ctrl_cmd_get_access_records,
+	},
+	{
+		.type    = CTRL_CMD_SET_ACCESS_BATCH,
+		.length  = 0,
+		.entry_size = sizeof(struct access_record),
+		.handler = ctrl_cmd_set_access_batch,
+	},
+	{
+		.type    = CTRL_CMD_SET_ACCESS_FORMAT,
+		.length  = sizeof(struct ctrl_cmd_set_access_format),
+		.handler = ctrl_cmd_set_access_format,
+	},
+	{
+		.type    = CTRL_CMD_GET_ACCESS_BOOT_WRITE_COUNTS,
+		.length  = sizeof(struct ctrl_cmd_get_access_boot_write_counts),
+		.handler = ctrl_cmd_get_access_boot_write_counts,
+	},
+	{
+		.type    = CTRL_CMD_GET_EVENT_STATS,
+		.length  = 0,
+		.handler = ctrl_cmd_get_event_stats,
+	},
+	{
+		.type    = CTRL_CMD_GET_TIMER_STATS,
+		.length  = sizeof(struct ctrl_cmd_get_timer_stats),
+		.handler = ctrl_cmd_get_timer_stats,
+	},
+	{
+		.type    = CTRL_CMD_GET_READER_STATS,
+		.length  = sizeof(struct ctrl_cmd_get_reader_stats),
+		.handler = ctrl_cmd_get_reader_stats,
+	},
 };
 
 static void on_ctrl_transport_received_msg(
@@ -180,12 +463,15 @@ static void on_ctrl_transport_received_msg(
 		goto error;
 	}
 
-	if (msg->length != desc.length) {
+	if (desc.entry_size ?
+	    (msg->length <= desc.length ||
+	     (msg->length - desc.length) % desc.entry_size) :
+	    msg->length != desc.length) {
 		err = -EINVAL;
 		goto error;
 	}
 
-	err = desc.handler(ctrl, msg->payload);
+	err = desc.handler(ctrl, msg->payload, msg->length);
 error:
 	if (err)
 		ctrl_transport_reply(ctrl, CTRL_CMD_ERROR,
@@ -204,13 +490,34 @@ static void on_ctrl_transport_event(
 	}
 }
 
+static void on_eeprom_event(
+	uint8_t event, union event_val val, void *context)
+{
+	struct ctrl_transport *ctrl = context;
+
+	if (!reply_pending || !eeprom_write_done(reply_write_seq))
+		return;
+
+	reply_pending = 0;
+	ctrl_transport_reply(ctrl, CTRL_CMD_OK, reply_payload, reply_length);
+}
+
 static struct ctrl_transport ctrl_transport;
 static struct event_handler ctrl_transport_handler = {
 	.source = &ctrl_transport,
+	.source_id = EVENT_SOURCE_CTRL,
 	.handler = on_ctrl_transport_event,
 	.context = &ctrl_transport,
 };
 
+static struct event_handler eeprom_handler = {
+	.source = &eeprom_write_queue,
+	.source_id = EVENT_SOURCE_EEPROM,
+	.id = EEPROM_EVENT_WRITE_DONE,
+	.handler = on_eeprom_event,
+	.context = &ctrl_transport,
+};
+
 int8_t ctrl_cmd_init(void)
 {
 	int8_t err;
@@ -219,6 +526,10 @@ int8_t ctrl_cmd_init(void)
 	if (err)
 		return err;
 
+	err = event_handler_add(&eeprom_handler);
+	if (err)
+		return err;
+
 	return event_handler_add(&ctrl_transport_handler);
 }
 
@@ -10,11 +10,11 @@ struct ctrl_transport;
 
 int8_t ctrl_transport_init(struct ctrl_transport *ctrl);
 
-/* Send a reply to a command */
+/* Send a reply to a command, the payload is copied */
 int8_t ctrl_transport_reply(struct ctrl_transport *ctrl, uint8_t type,
 			    const void *payload, uint8_t length);
 
-/* Send an event */
+/* Send an event, wait until it has been sent */
 int8_t ctrl_transport_send_event(struct ctrl_transport *ctrl, uint8_t type,
 				 const void *payload, uint8_t length);
 
@@ -15,15 +15,22 @@
 #define DOOR_OPEN_FROM_READER		0
 #define DOOR_OPEN_FROM_BUTTON		1
 
-static const uint16_t buzzer_rejected_seq[] = {
+/* Each door has a reader, 3 triggers, 2 buttons and the idle timer,
+ * all of them can be pending at the same time. */
+#define DOOR_CTRL_NUM_TIMERS		7
+
+_Static_assert(NUM_DOORS * DOOR_CTRL_NUM_TIMERS <= MAX_TIMERS,
+	       "Not enough timers for all the doors");
+
+static const uint16_t buzzer_rejected_seq[] PROGMEM = {
 	0, 200, 600, 200, 600, 200, 600
 };
 
-static const uint16_t buzzer_timeout_seq[] = {
+static const uint16_t buzzer_timeout_seq[] PROGMEM = {
 	0, 100, 200, 100, 200, 100, 200
 };
 
-static const uint16_t buzzer_accepted_seq[] = {
+static const uint16_t buzzer_accepted_seq[] PROGMEM = {
 	0, 100, 200 /*, 100, 200*/
 };
 
@@ -84,8 +91,8 @@ static void door_ctrl_set_state(struct door_ctrl *dc, enum door_state state)
 		break;
 	}
 #if DEBUG
-	event_add(&dc->wr, DOOR_CTRL_EVENT_STATE_CHANGED,
-		  EVENT_VAL((uint32_t)state));
+	event_add_prio(&dc->wr, DOOR_CTRL_EVENT_STATE_CHANGED,
+		       EVENT_VAL((uint32_t)state), EVENT_PRIO_LOW);
 #endif
 }
 
@@ -93,14 +100,16 @@ static void on_idle_timeout(void *context)
 {
 	struct door_ctrl *dc = context;
 
-	event_add(&dc->wr, DOOR_CTRL_EVENT_IDLE_TIMEOUT, EVENT_VAL(NULL));
+	event_add_prio(&dc->wr, DOOR_CTRL_EVENT_IDLE_TIMEOUT, EVENT_VAL(NULL),
+		       EVENT_PRIO_HIGH);
 }
 
 static void on_buzzer_finished(void *context)
 {
 	struct door_ctrl *dc = context;
 
-	event_add(&dc->wr, DOOR_CTRL_EVENT_BUZZER_FINISHED, EVENT_VAL(NULL));
+	event_add_prio(&dc->wr, DOOR_CTRL_EVENT_BUZZER_FINISHED,
+		       EVENT_VAL(NULL), EVENT_PRIO_HIGH);
 }
 
 static int8_t door_ctrl_check_key(struct door_ctrl *dc,
@@ -189,7 +198,7 @@ static void on_event(uint8_t event, union event_val val, void *context)
 		door_ctrl_timeout(dc);
 		return;
 	case WIEGAND_READER_ERROR:
-		/* TODO: Handle protocol errors */
+		/* The details are counted in the reader statistics */
 		door_ctrl_error(dc);
 		return;
 	case WIEGAND_READER_EVENT_KEY:
@@ -289,16 +298,19 @@ int8_t door_ctrl_init(struct door_ctrl *dc,
 	dc->check_context = cfg->check_context;
 
 	dc->hdlr.source = &dc->wr;
+	dc->hdlr.source_id = EVENT_SOURCE_READER(dc->door_id);
 	dc->hdlr.handler = on_event;
 	dc->hdlr.context = dc;
 
-	timer_init(&dc->idle_timer, on_idle_timeout, dc);
+	/* The idle timeout just post an event, it can run in the ISR */
+	timer_init(&dc->idle_timer, on_idle_timeout, dc, TIMER_FLAG_ISR);
 
 	err = event_handler_add(&dc->hdlr);
 	if (err)
 		return err;
 
-	err = wiegand_reader_init(&dc->wr, cfg->d0_irq, cfg->d1_irq);
+	err = wiegand_reader_init(&dc->wr, cfg->d0_irq, cfg->d1_irq,
+				  cfg->wiegand_formats);
 	if (err)
 		return err;
 
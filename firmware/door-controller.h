@@ -23,6 +23,8 @@ struct door_ctrl_config {
 	uint8_t d1_irq;
 
 	uint16_t open_time;
+	/* Bitmask of the accepted Wiegand card formats */
+	uint8_t wiegand_formats;
 
 	uint8_t open_gpio;
 	uint8_t led_gpio;
@@ -9,13 +9,18 @@
 #define ACCESS_TYPE_CARD		2
 #define ACCESS_TYPE_CARD_AND_PIN	(ACCESS_TYPE_PIN | ACCESS_TYPE_CARD)
 
+/* Format used to store the access records in the EEPROM */
+#define ACCESS_FORMAT_V1		1 /* 5 bytes, 32 bits keys */
+#define ACCESS_FORMAT_V2		2 /* 4 bytes, 26 bits keys, 2 doors */
+
 struct access_record {
 	/* Pin code or card number */
 	uint32_t key;
 	/* Pin or key */
 	uint8_t type   : 2;
 	uint8_t invalid: 1;
-	uint8_t resvd  : 1;
+	/* Records from another epoch than the current one are unused */
+	uint8_t epoch  : 1;
 	/* Doors that can be opened with this token */
 	uint8_t doors  : 4;
 } PACKED;
@@ -30,6 +35,10 @@ struct door_config {
 	/* Bitmask of the week days with open access */
 	uint8_t open_access_days;
 
+	/* Bitmask of the Wiegand card formats accepted by the reader,
+	 * 0xFF select the default formats. */
+	uint8_t wiegand_formats;
+
 	/* Reserved */
 	uint8_t reserved[];
 } PACKED;
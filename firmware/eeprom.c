@@ -1,77 +1,927 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
+#include <string.h>
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 #include "eeprom.h"
+#include "event-queue.h"
+#include "sleep.h"
 #include "utils.h"
 
 static struct eeprom_config config EEMEM;
 
-uint16_t eeprom_get_free_access_record_count(void)
+/* Writing a byte takes about 3.3ms, so the writes are queued and done
+ * from the EE_READY interrupt. All reads must go through eeprom_read()
+ * to see the data that is still in the queue. Bytes that already have
+ * the right value are skipped to save time and wear. */
+#ifndef EEPROM_WRITE_QUEUE_SIZE
+#define EEPROM_WRITE_QUEUE_SIZE		4
+#endif
+#define EEPROM_WRITE_MAX_LENGTH		8
+
+struct eeprom_write {
+	uint8_t *addr;
+	uint8_t length;
+	uint8_t data[EEPROM_WRITE_MAX_LENGTH];
+};
+
+struct eeprom_write_queue {
+	struct eeprom_write write[EEPROM_WRITE_QUEUE_SIZE];
+	uint8_t head;
+	uint8_t volatile count;
+	/* Next byte to write from the head entry */
+	uint8_t pos;
+	/* Set when the completion event still has to be sent */
+	uint8_t volatile notify;
+	/* Sequence number of the last queued and completed writes */
+	uint8_t queued_seq;
+	uint8_t volatile done_seq;
+};
+
+struct eeprom_write_queue eeprom_write_queue;
+
+uint8_t eeprom_write_seq(void)
 {
-	struct access_record rec;
-	uint16_t i, count = 0;
+	return eeprom_write_queue.queued_seq;
+}
+
+uint8_t eeprom_write_done(uint8_t seq)
+{
+	return (int8_t)(eeprom_write_queue.done_seq - seq) >= 0;
+}
 
-	for (i = 0; i < ARRAY_SIZE(config.access); i++) {
-		eeprom_read_block(&rec, &config.access[i], sizeof(rec));
-		if (rec.invalid || rec.type == ACCESS_TYPE_NONE)
-			count++;
+static void eeprom_read(void *data, const void *addr, uint8_t length)
+{
+	struct eeprom_write_queue *wq = &eeprom_write_queue;
+	const struct eeprom_write *w;
+	uint16_t offset;
+	uint8_t i, j;
+
+	/* Pause the queue while reading */
+	EECR &= ~BIT(EERIE);
+
+	eeprom_read_block(data, addr, length);
+
+	/* Overlay the data that is still waiting to be written */
+	for (i = 0; i < wq->count; i++) {
+		w = &wq->write[(wq->head + i) % ARRAY_SIZE(wq->write)];
+		for (j = 0; j < w->length; j++) {
+			offset = w->addr + j - (const uint8_t *)addr;
+			if (offset < length)
+				((uint8_t *)data)[offset] = w->data[j];
+		}
 	}
 
-	return count;
+	if (wq->count)
+		EECR |= BIT(EERIE);
 }
 
-int8_t eeprom_get_access_record(uint16_t id, struct access_record *rec)
+static void eeprom_write(const void *data, void *addr, uint8_t length)
 {
-	if (id >= ARRAY_SIZE(config.access))
-		return -EINVAL;
+	struct eeprom_write_queue *wq = &eeprom_write_queue;
+	struct eeprom_write *w;
+	uint8_t len;
 
-	eeprom_read_block(rec, &config.access[id], sizeof(*rec));
-	return 0;
+	/* The queue can't run without interrupts, this is only
+	 * the case during the init, simply write synchronously. */
+	if (!(SREG & BIT(SREG_I))) {
+		eeprom_update_block(data, addr, length);
+		return;
+	}
+
+	while (length > 0) {
+		len = length;
+		if (len > EEPROM_WRITE_MAX_LENGTH)
+			len = EEPROM_WRITE_MAX_LENGTH;
+
+		sleep_while(wq->count >= ARRAY_SIZE(wq->write));
+
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			w = &wq->write[(wq->head + wq->count) %
+				       ARRAY_SIZE(wq->write)];
+			w->addr = addr;
+			w->length = len;
+			memcpy(w->data, data, len);
+			wq->count++;
+			wq->queued_seq++;
+			EECR |= BIT(EERIE);
+		}
+
+		data = (const uint8_t *)data + len;
+		addr = (uint8_t *)addr + len;
+		length -= len;
+	}
 }
 
-int8_t eeprom_set_access_record(uint16_t id, const struct access_record *rec)
+/* Must be called with interrupts disabled */
+static void eeprom_notify_write_done(void)
 {
-	if (id >= ARRAY_SIZE(config.access))
-		return -EINVAL;
+	struct eeprom_write_queue *wq = &eeprom_write_queue;
+
+	/* A pending event just get the new sequence number */
+	if (!event_add_prio(&eeprom_write_queue, EEPROM_EVENT_WRITE_DONE,
+			    EVENT_UINT(wq->done_seq),
+			    EVENT_PRIO_NORMAL | EVENT_COALESCE))
+		wq->notify = 0;
+}
+
+/* Retry sending the write done event if the event queue was full */
+static void eeprom_post_write_done(void)
+{
+	if (!eeprom_write_queue.notify)
+		return;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		if (eeprom_write_queue.notify)
+			eeprom_notify_write_done();
+}
 
-	eeprom_write_block(rec, &config.access[id], sizeof(*rec));
+ISR(EE_READY_vect)
+{
+	struct eeprom_write_queue *wq = &eeprom_write_queue;
+	struct eeprom_write *w = NULL;
+
+	while (wq->count) {
+		w = &wq->write[wq->head];
+		/* The last byte of the head entry has been written */
+		if (wq->pos >= w->length) {
+			wq->head = (wq->head + 1) % ARRAY_SIZE(wq->write);
+			wq->count--;
+			wq->pos = 0;
+			wq->done_seq++;
+			wq->notify = 1;
+			continue;
+		}
+		/* Skip the bytes that already have the right value */
+		if (eeprom_read_byte(w->addr + wq->pos) != w->data[wq->pos])
+			break;
+		wq->pos++;
+	}
+
+	/* If the event queue is full the event loop will retry once
+	 * an event has been freed. */
+	if (wq->notify)
+		eeprom_notify_write_done();
+
+	/* The interrupt is level triggered, so it must be disabled
+	 * when there is nothing more to write. */
+	if (!wq->count) {
+		EECR &= ~BIT(EERIE);
+		return;
+	}
+
+	EEAR = (uint16_t)(w->addr + wq->pos);
+	EEDR = w->data[wq->pos++];
+	EECR |= BIT(EEMPE);
+	EECR |= BIT(EEPE);
+}
+
+/* Set when the records are placed according to their hash */
+static uint8_t index_clean;
+
+static uint8_t access_format;
+/* Number of records in the current format */
+static uint16_t num_access_records;
+
+/* Fingerprint of the key of each record, this allow skipping most
+ * EEPROM reads during a lookup. */
+#define FINGERPRINT_UNUSED		0
+#define FINGERPRINT_STALE		1 /* Unused, from an old epoch */
+#define FINGERPRINT_REMOVED		2
+#define FINGERPRINT_FIRST		3
+
+#if ACCESS_FINGERPRINTS
+static uint8_t access_fingerprints[NUM_ACCESS_RECORDS];
+#endif
+
+#if ACCESS_BOOT_WRITE_COUNTS
+/* Number of times each record has been written since boot, saturate
+ * at 255. They are only kept in RAM, so they only show the wear since
+ * the last boot. New records go to the least written free record. */
+static uint8_t access_write_counts[NUM_ACCESS_RECORDS];
+
+static uint8_t access_write_count(uint16_t id)
+{
+	return access_write_counts[id];
+}
+
+static void access_write_count_inc(uint16_t id)
+{
+	if (access_write_counts[id] < UINT8_MAX)
+		access_write_counts[id]++;
+}
+#else
+/* Without the counts new records go to the first free record */
+static uint8_t access_write_count(uint16_t id)
+{
 	return 0;
 }
 
+static void access_write_count_inc(uint16_t id)
+{
+}
+#endif
+
+/* Number of free records in the fingerprint table */
+static uint16_t free_access_records;
+
+/* Sum of the digest of all used records */
+static uint16_t acl_hash;
+
+static uint16_t acl_generation;
+/* Set once the current generation has been read */
+static uint8_t acl_generation_read;
+
+static uint8_t acl_epoch;
+/* Number of records from the old epoch that must still be invalidated */
+static uint16_t stale_access_records;
+/* Number of invalid records, the others become stale on the next epoch */
+static uint16_t unused_access_records;
+
+_Static_assert(((ACCESS_FINGERPRINTS ? NUM_ACCESS_RECORDS : 0) +
+		(ACCESS_BOOT_WRITE_COUNTS ? NUM_ACCESS_RECORDS : 0)) <=
+	       RAM_SIZE / 4,
+	       "Access fingerprints and write counts use too much RAM");
+
+static uint16_t eeprom_access_hash(uint8_t type, uint32_t key)
+{
+	uint16_t h;
+
+	h = (uint16_t)key ^ (uint16_t)(key >> 16) ^ type;
+	h *= 40503; /* 2^16 / golden ratio */
+
+	return h;
+}
+
+static uint16_t eeprom_access_slot(uint8_t type, uint32_t key)
+{
+	return eeprom_access_hash(type, key) % num_access_records;
+}
+
+static uint8_t eeprom_access_fingerprint(uint8_t type, uint32_t key)
+{
+	uint16_t h = eeprom_access_hash(type, key);
+	uint8_t fp = (h >> 8) ^ h;
+
+	return fp < FINGERPRINT_FIRST ? fp + FINGERPRINT_FIRST : fp;
+}
+
+static uint8_t access_record_fingerprint(const struct access_record *rec)
+{
+	if (rec->invalid)
+		return FINGERPRINT_UNUSED;
+	if (rec->epoch != acl_epoch)
+		return FINGERPRINT_STALE;
+	if (rec->type == ACCESS_TYPE_NONE)
+		return FINGERPRINT_REMOVED;
+	return eeprom_access_fingerprint(rec->type, rec->key);
+}
+
+/* Digest of a used record in the form used by the set commands, this
+ * allow the host to compute the ACL hash from its own records. The
+ * xmodem CRC is linear, so it is mixed with multiplies before being
+ * summed, otherwise swapping the doors of two records would give the
+ * same hash. */
+static uint16_t eeprom_access_digest(const struct access_record *rec)
+{
+	struct access_record r = *rec;
+	uint16_t h = 0;
+	uint8_t i;
+
+	r.invalid = 0;
+	r.epoch = 0;
+	for (i = 0; i < sizeof(r); i++)
+		h = _crc_xmodem_update(h, ((uint8_t *)&r)[i]);
+
+	h ^= h >> 8;
+	h *= 0x88B5;
+	h ^= h >> 7;
+	h *= 0xDB2D;
+	h ^= h >> 9;
+
+	return h;
+}
+
+/* Check that a record can be stored in the current format */
+static uint8_t access_record_fits(const struct access_record *rec)
+{
+	struct access_record_v2 r;
+
+	if (access_format == ACCESS_FORMAT_V1)
+		return 1;
+
+	r.key = rec->key;
+	return r.key == (int32_t)rec->key && !(rec->doors >> 2);
+}
+
+static void eeprom_read_access_record(uint16_t id, struct access_record *rec)
+{
+	struct access_record_v2 r;
+
+	if (access_format == ACCESS_FORMAT_V1) {
+		eeprom_read(rec, &config.access.v1[id], sizeof(*rec));
+		return;
+	}
+
+	eeprom_read(&r, &config.access.v2[id], sizeof(r));
+	rec->key = r.key;
+	rec->type = r.type;
+	rec->invalid = r.invalid;
+	rec->epoch = r.epoch;
+	rec->doors = r.doors;
+}
+
+#if ACCESS_FINGERPRINTS
+static uint8_t access_fingerprint(uint16_t id)
+{
+	return access_fingerprints[id];
+}
+#else
+/* Without the table the fingerprints are computed from the records */
+static uint8_t access_fingerprint(uint16_t id)
+{
+	struct access_record rec;
+
+	eeprom_read_access_record(id, &rec);
+	return access_record_fingerprint(&rec);
+}
+#endif
+
+static uint8_t access_record_is_free(uint16_t id)
+{
+	return access_fingerprint(id) < FINGERPRINT_FIRST;
+}
+
+static uint8_t access_record_is_unused(uint16_t id)
+{
+	return access_fingerprint(id) <= FINGERPRINT_STALE;
+}
+
+/* Must be called before the record is written, as without the
+ * table the old fingerprint is read from the EEPROM. */
+static void eeprom_set_access_fingerprint(uint16_t id, uint8_t fp)
+{
+	uint8_t old = access_fingerprint(id);
+
+	free_access_records -= (old < FINGERPRINT_FIRST);
+	stale_access_records -= (old == FINGERPRINT_STALE);
+	unused_access_records -= (old == FINGERPRINT_UNUSED);
+#if ACCESS_FINGERPRINTS
+	access_fingerprints[id] = fp;
+#endif
+	free_access_records += (fp < FINGERPRINT_FIRST);
+	stale_access_records += (fp == FINGERPRINT_STALE);
+	unused_access_records += (fp == FINGERPRINT_UNUSED);
+}
+
+static void eeprom_write_access_record(uint16_t id,
+				       const struct access_record *rec)
+{
+	struct access_record_v2 r;
+	struct access_record old;
+	uint8_t fp;
+
+	/* Don't rewrite records that don't change */
+	eeprom_read_access_record(id, &old);
+	if (!memcmp(&old, rec, sizeof(old)))
+		return;
+
+	access_write_count_inc(id);
+
+	if (!access_record_is_free(id))
+		acl_hash -= eeprom_access_digest(&old);
+
+	fp = access_record_fingerprint(rec);
+	eeprom_set_access_fingerprint(id, fp);
+	if (fp >= FINGERPRINT_FIRST)
+		acl_hash += eeprom_access_digest(rec);
+
+	if (access_format == ACCESS_FORMAT_V1) {
+		eeprom_write(rec, &config.access.v1[id], sizeof(*rec));
+		return;
+	}
+
+	r.key = rec->key;
+	r.type = rec->type;
+	r.invalid = rec->invalid;
+	r.epoch = rec->epoch;
+	r.doors = rec->doors;
+	eeprom_write(&r, &config.access.v2[id], sizeof(r));
+}
+
+/* Lookup a record, on success index is set to the record index.
+ * Otherwise index is set to the least written free record where this
+ * key can be inserted, or to num_access_records if the table is full. */
 static int8_t eeprom_find_access_record(uint8_t type, uint32_t key,
 					struct access_record *rec,
 					uint16_t *index)
 {
-	uint16_t i;
+	uint16_t i, n, free = num_access_records;
+	uint8_t fp = eeprom_access_fingerprint(type, key);
 
-	for (i = 0; i < ARRAY_SIZE(config.access); i++) {
-		eeprom_read_block(rec, &config.access[i], sizeof(*rec));
-		switch (type) {
-		case ACCESS_TYPE_NONE:
-			if (rec->invalid || rec->type == ACCESS_TYPE_NONE)
+	/* Without a valid index fallback on a linear search */
+	i = index_clean ? eeprom_access_slot(type, key) : 0;
+
+	for (n = 0; n < num_access_records; n++) {
+		if (access_record_is_free(i)) {
+			if (free >= num_access_records ||
+			    access_write_count(i) < access_write_count(free))
+				free = i;
+			/* Unused records terminate the probe sequence */
+			if (index_clean && access_record_is_unused(i))
 				break;
+		} else if (access_fingerprint(i) == fp) {
+			eeprom_read_access_record(i, rec);
+			if (rec->type == type && rec->key == key) {
+				*index = i;
+				return 0;
+			}
+		}
+		if (++i >= num_access_records)
+			i = 0;
+	}
+
+	*index = free;
+	return -ENOENT;
+}
+
+static void eeprom_set_index_clean(uint8_t clean)
+{
+	uint8_t state;
+
+	if (index_clean == clean)
+		return;
+
+	if (access_format == ACCESS_FORMAT_V2)
+		state = clean ? EEPROM_INDEX_V2_CLEAN : EEPROM_INDEX_V2_DIRTY;
+	else
+		state = clean ? EEPROM_INDEX_CLEAN : EEPROM_INDEX_DIRTY;
+
+	eeprom_write(&state, &config.state.index_state, sizeof(state));
+	index_clean = clean;
+}
+
+/* Move the records to the first free record of their probe sequence
+ * until none can be moved anymore. As each move shorten a probe
+ * sequence this always terminates, and gives the same probe lengths
+ * as if all the records had been added with eeprom_set_access(). */
+static void eeprom_rebuild_access_index(void)
+{
+	struct access_record rec, r;
+	uint8_t moved, fp;
+	uint16_t i, j;
+
+	do {
+		moved = 0;
+		for (i = 0; i < num_access_records; i++) {
+			if (access_record_is_free(i))
+				continue;
+
+			eeprom_read_access_record(i, &rec);
+			fp = access_record_fingerprint(&rec);
+			for (j = eeprom_access_slot(rec.type, rec.key);
+			     j != i;) {
+				if (access_record_is_free(j)) {
+					eeprom_write_access_record(j, &rec);
+					break;
+				}
+				/* Drop duplicates, the first one is used */
+				if (access_fingerprint(j) == fp) {
+					eeprom_read_access_record(j, &r);
+					if (r.type == rec.type &&
+					    r.key == rec.key)
+						break;
+				}
+				if (++j >= num_access_records)
+					j = 0;
+			}
+
+			/* The record is already at its best place */
+			if (j == i)
+				continue;
+
+			/* Leave a removed record to keep the other
+			 * probe sequences going through this one intact */
+			rec.type = ACCESS_TYPE_NONE;
+			rec.key = 0;
+			eeprom_write_access_record(i, &rec);
+			moved = 1;
+		}
+	} while (moved);
+
+	eeprom_set_index_clean(1);
+}
+
+/* Turn the removed records that are not on any probe sequence
+ * into unused records to keep the lookup of unknown keys short. */
+static void eeprom_purge_removed_records(void)
+{
+	uint8_t used[(NUM_ACCESS_RECORDS + 7) / 8] = {};
+	struct access_record rec;
+	uint16_t i, j;
+
+	for (i = 0; i < num_access_records; i++) {
+		if (access_record_is_free(i))
 			continue;
-		default:
-			if (!rec->invalid &&
-			    rec->type == type && rec->key == key)
-				break;
+		eeprom_read_access_record(i, &rec);
+		/* Mark all the records on this probe sequence */
+		for (j = eeprom_access_slot(rec.type, rec.key); j != i;) {
+			used[j >> 3] |= BIT(j & 7);
+			if (++j >= num_access_records)
+				j = 0;
+		}
+	}
+
+	for (i = 0; i < num_access_records; i++) {
+		if (used[i >> 3] & BIT(i & 7) ||
+		    access_fingerprint(i) != FINGERPRINT_REMOVED)
+			continue;
+		eeprom_read_access_record(i, &rec);
+		rec.invalid = 1;
+		eeprom_write_access_record(i, &rec);
+	}
+}
+
+/* Invalidate the next record from the old epoch. To not block the
+ * event loop this is only done when the write queue isn't full, and
+ * continued when the writes complete. */
+static void eeprom_cleanup_stale_record(void)
+{
+	static uint16_t i;
+	struct access_record rec;
+
+	if (eeprom_write_queue.count >= ARRAY_SIZE(eeprom_write_queue.write))
+		return;
+
+	for (; stale_access_records > 0; i++) {
+		if (i >= num_access_records)
+			i = 0;
+		if (access_fingerprint(i) != FINGERPRINT_STALE)
+			continue;
+		eeprom_read_access_record(i, &rec);
+		rec.invalid = 1;
+		eeprom_write_access_record(i, &rec);
+		break;
+	}
+}
+
+static void on_eeprom_event(uint8_t event, union event_val val, void *context)
+{
+	eeprom_cleanup_stale_record();
+}
+
+static struct event_handler eeprom_handler = {
+	.source = &eeprom_write_queue,
+	.source_id = EVENT_SOURCE_EEPROM,
+	.handler = on_eeprom_event,
+	.slot_freed = eeprom_post_write_done,
+};
+
+static void eeprom_write_acl_generation(void)
+{
+	uint16_t gen = acl_generation & EEPROM_ACL_GENERATION_MASK;
+
+	if (!acl_epoch)
+		gen |= EEPROM_ACL_EPOCH_N;
+
+	eeprom_write(&gen, &config.state.acl_generation, sizeof(gen));
+}
+
+static void eeprom_acl_modified(void)
+{
+	if (!acl_generation_read)
+		return;
+
+	acl_generation = (acl_generation + 1) & EEPROM_ACL_GENERATION_MASK;
+	acl_generation_read = 0;
+	eeprom_write_acl_generation();
+}
+
+static void eeprom_load_access_format(uint8_t format)
+{
+	access_format = format;
+	if (format == ACCESS_FORMAT_V2)
+		num_access_records = NUM_ACCESS_RECORDS_V2;
+	else
+		num_access_records = NUM_ACCESS_RECORDS_V1;
+}
+
+/* Erase all the access records and switch to another format. The
+ * state is written first, so an interrupted erase is restarted on
+ * the next boot. */
+static void eeprom_format_access_records(uint8_t format)
+{
+	uint8_t *addr = (uint8_t *)&config.access;
+	uint8_t data[sizeof(struct access_record)];
+	uint8_t erased[sizeof(struct access_record)];
+	uint8_t state, size;
+	uint16_t i, len;
+
+	state = (format == ACCESS_FORMAT_V2) ?
+		EEPROM_INDEX_ERASE_V2 : EEPROM_INDEX_ERASE_V1;
+	eeprom_write(&state, &config.state.index_state, sizeof(state));
+
+	eeprom_load_access_format(format);
+	size = (format == ACCESS_FORMAT_V2) ?
+		sizeof(struct access_record_v2) : sizeof(struct access_record);
+
+#if ACCESS_BOOT_WRITE_COUNTS
+	/* The records of the new format are at other offsets */
+	memset(access_write_counts, 0, sizeof(access_write_counts));
+#endif
+	/* Erase the records one by one to only count the records
+	 * that are really written. */
+	memset(erased, 0xFF, sizeof(erased));
+	for (i = 0; i < sizeof(config.access); i += len) {
+		len = sizeof(config.access) - i;
+		if (len > size)
+			len = size;
+		eeprom_read(data, addr + i, len);
+		if (!memcmp(data, erased, len))
 			continue;
+		eeprom_write(erased, addr + i, len);
+		if (i / size < num_access_records)
+			access_write_count_inc(i / size);
+	}
+
+#if ACCESS_FINGERPRINTS
+	memset(access_fingerprints, FINGERPRINT_UNUSED,
+	       sizeof(access_fingerprints));
+#endif
+	free_access_records = num_access_records;
+	stale_access_records = 0;
+	unused_access_records = num_access_records;
+	acl_hash = 0;
+
+	/* An empty table is always properly indexed */
+	index_clean = 0;
+	eeprom_set_index_clean(1);
+
+	acl_generation = (acl_generation + 1) & EEPROM_ACL_GENERATION_MASK;
+	acl_generation_read = 0;
+	eeprom_write_acl_generation();
+}
+
+_Static_assert(sizeof(struct eeprom_config) == EEPROM_SIZE,
+	       "The EEPROM config must fill the EEPROM");
+_Static_assert(offsetof(struct door_config, wiegand_formats) ==
+	       DOOR_CONFIG_EEPROM_SIZE,
+	       "The Wiegand formats must follow the stored door config");
+_Static_assert(offsetof(struct eeprom_config, state.layout) == EEPROM_SIZE - 1,
+	       "The layout must be in the last byte of the EEPROM");
+
+static uint8_t access_record_is_used(const struct access_record *rec)
+{
+	return !rec->invalid && rec->type != ACCESS_TYPE_NONE;
+}
+
+/* Move a record of the baseline table that is past the end of the
+ * current table to a free record, unless it has already been moved.
+ * If the table is full the record is lost, the ACL hash then tells
+ * the host about it. */
+static void eeprom_move_baseline_record(struct access_record *rec)
+{
+	struct access_record r;
+	uint16_t i, free = num_access_records;
+
+	for (i = 0; i < num_access_records; i++) {
+		eeprom_read_access_record(i, &r);
+		if (!access_record_is_used(&r)) {
+			if (free >= num_access_records)
+				free = i;
+		} else if (r.type == rec->type && r.key == rec->key) {
+			return;
 		}
-		/* found */
-		if (index)
-			*index = i;
+	}
+
+	if (free < num_access_records)
+		eeprom_write_access_record(free, rec);
+}
+
+/* Convert from the baseline layout. The records stay in place and
+ * the index is rebuilt as for a dirty table. Baseline records have
+ * the epoch bit set unless they were uploaded with the record command,
+ * so epoch 1 is used. Every step can be repeated and the layout is
+ * written last, so an interrupted conversion is simply restarted on
+ * the next boot. An erased EEPROM is converted like an empty table. */
+static void eeprom_convert_baseline(void)
+{
+	uint8_t layout = EEPROM_LAYOUT_MAGIC;
+	uint8_t state = EEPROM_INDEX_DIRTY;
+	uint8_t formats[NUM_DOORS];
+	struct access_record rec;
+	uint16_t i;
+
+	eeprom_load_access_format(ACCESS_FORMAT_V1);
+	acl_epoch = 1;
+	acl_generation = 0;
+
+	/* Put all the used records in the current epoch */
+	for (i = 0; i < num_access_records; i++) {
+		eeprom_read_access_record(i, &rec);
+		if (!access_record_is_used(&rec) || rec.epoch == acl_epoch)
+			continue;
+		rec.epoch = acl_epoch;
+		eeprom_write_access_record(i, &rec);
+	}
+
+	/* The last records overlap the formats and the state. Once moved
+	 * they are invalidated, that only rewrite their flags byte, so
+	 * they are not read back from the state after a restart. */
+	for (; i < NUM_ACCESS_RECORDS_BASELINE; i++) {
+		eeprom_read(&rec, &config.access.v1[i], sizeof(rec));
+		if (!access_record_is_used(&rec))
+			continue;
+		rec.epoch = acl_epoch;
+		eeprom_move_baseline_record(&rec);
+		rec.invalid = 1;
+		eeprom_write(&rec, &config.access.v1[i], sizeof(rec));
+	}
+
+	/* Use the default formats on all the doors */
+	memset(formats, 0xFF, sizeof(formats));
+	eeprom_write(formats, config.wiegand_formats, sizeof(formats));
+	eeprom_write_acl_generation();
+	eeprom_write(&state, &config.state.index_state, sizeof(state));
+	eeprom_write(&layout, &config.state.layout, sizeof(layout));
+}
+
+void eeprom_init(void)
+{
+	struct access_record rec;
+	uint8_t layout, state, fp;
+	uint16_t i;
+
+	eeprom_read(&layout, &config.state.layout, sizeof(layout));
+	if (layout != EEPROM_LAYOUT_MAGIC)
+		eeprom_convert_baseline();
+
+	eeprom_read(&acl_generation, &config.state.acl_generation,
+		    sizeof(acl_generation));
+	acl_epoch = !(acl_generation & EEPROM_ACL_EPOCH_N);
+	acl_generation &= EEPROM_ACL_GENERATION_MASK;
+	acl_generation_read = 1;
+
+	eeprom_read(&state, &config.state.index_state, sizeof(state));
+
+	/* Finish an interrupted format switch */
+	if (state == EEPROM_INDEX_ERASE_V1 || state == EEPROM_INDEX_ERASE_V2) {
+		eeprom_format_access_records(state == EEPROM_INDEX_ERASE_V2 ?
+					     ACCESS_FORMAT_V2 :
+					     ACCESS_FORMAT_V1);
+		eeprom_read(&state, &config.state.index_state,
+			    sizeof(state));
+	}
+
+	if (state == EEPROM_INDEX_V2_CLEAN || state == EEPROM_INDEX_V2_DIRTY)
+		eeprom_load_access_format(ACCESS_FORMAT_V2);
+	else
+		eeprom_load_access_format(ACCESS_FORMAT_V1);
+	index_clean = (state == EEPROM_INDEX_CLEAN ||
+		       state == EEPROM_INDEX_V2_CLEAN);
+
+	/* Load the fingerprints */
+	free_access_records = 0;
+	stale_access_records = 0;
+	unused_access_records = 0;
+	acl_hash = 0;
+	for (i = 0; i < num_access_records; i++) {
+		eeprom_read_access_record(i, &rec);
+		fp = access_record_fingerprint(&rec);
+#if ACCESS_FINGERPRINTS
+		access_fingerprints[i] = fp;
+#endif
+		if (fp == FINGERPRINT_STALE)
+			stale_access_records++;
+		if (fp == FINGERPRINT_UNUSED)
+			unused_access_records++;
+		if (fp < FINGERPRINT_FIRST)
+			free_access_records++;
+		else
+			acl_hash += eeprom_access_digest(&rec);
+	}
+
+	if (!index_clean)
+		eeprom_rebuild_access_index();
+
+	eeprom_purge_removed_records();
+
+	event_handler_add(&eeprom_handler);
+	/* Finish the cleanup of the last epoch */
+	if (stale_access_records)
+		event_add_prio(&eeprom_write_queue, EEPROM_EVENT_CLEANUP,
+			       EVENT_VAL(NULL), EVENT_PRIO_LOW);
+}
+
+uint8_t eeprom_get_access_format(void)
+{
+	return access_format;
+}
+
+int8_t eeprom_set_access_format(uint8_t format)
+{
+	/* The compact format only has room for 2 doors */
+	if (format != ACCESS_FORMAT_V1 &&
+	    (format != ACCESS_FORMAT_V2 || NUM_DOORS > 2))
+		return -EINVAL;
+
+	if (format != access_format)
+		eeprom_format_access_records(format);
+
+	return 0;
+}
+
+uint16_t eeprom_get_access_record_count(void)
+{
+	return num_access_records;
+}
+
+#if ACCESS_BOOT_WRITE_COUNTS
+uint8_t eeprom_get_access_boot_write_count(uint16_t id)
+{
+	return id < num_access_records ? access_write_counts[id] : 0;
+}
+#endif
+
+uint16_t eeprom_get_free_access_record_count(void)
+{
+	return free_access_records;
+}
+
+uint16_t eeprom_get_acl_generation(void)
+{
+	acl_generation_read = 1;
+	return acl_generation;
+}
+
+uint16_t eeprom_get_acl_hash(void)
+{
+	return acl_hash;
+}
+
+/* Records from an old epoch are reported as invalid */
+static void eeprom_normalize_access_record(struct access_record *rec)
+{
+	if (rec->epoch != acl_epoch)
+		rec->invalid = 1;
+	rec->epoch = 0;
+}
+
+int8_t eeprom_get_access_record(uint16_t id, struct access_record *rec)
+{
+	if (id >= num_access_records)
+		return -EINVAL;
+
+	eeprom_read_access_record(id, rec);
+	eeprom_normalize_access_record(rec);
+	return 0;
+}
+
+int8_t eeprom_get_next_access_record(uint16_t *id, struct access_record *rec)
+{
+	uint16_t i;
+
+	for (i = *id; i < num_access_records; i++) {
+		if (access_record_is_free(i))
+			continue;
+		eeprom_read_access_record(i, rec);
+		eeprom_normalize_access_record(rec);
+		*id = i;
 		return 0;
 	}
 
+	*id = num_access_records;
 	return -ENOENT;
 }
 
+int8_t eeprom_set_access_record(uint16_t id, const struct access_record *rec)
+{
+	struct access_record r = *rec;
+
+	if (id >= num_access_records)
+		return -EINVAL;
+
+	r.epoch = acl_epoch;
+	if (!access_record_fits(&r))
+		return -ERANGE;
+
+	/* The record might not be on its probe sequence anymore */
+	eeprom_set_index_clean(0);
+	eeprom_write_access_record(id, &r);
+	eeprom_acl_modified();
+	return 0;
+}
+
 int8_t eeprom_get_access(uint8_t type, uint32_t key, uint8_t *doors)
 {
 	struct access_record rec;
+	uint16_t index;
 	int8_t err;
 
-	err = eeprom_find_access_record(type, key, &rec, NULL);
+	err = eeprom_find_access_record(type, key, &rec, &index);
 	if (err < 0)
 		return err;
 
@@ -96,7 +946,7 @@ int8_t eeprom_has_access(uint8_t type, uint32_t key, uint8_t door_id)
 int8_t eeprom_set_access(uint8_t type, uint32_t key, uint8_t doors)
 {
 	struct access_record rec;
-	uint16_t index;
+	uint16_t index, next;
 	int8_t err;
 
 	if (type == ACCESS_TYPE_NONE)
@@ -108,42 +958,75 @@ int8_t eeprom_set_access(uint8_t type, uint32_t key, uint8_t doors)
 		if (doors == 0)
 			return 0;
 
-		/* Find a free record */
-		err = eeprom_find_access_record(
-			ACCESS_TYPE_NONE, 0, &rec, &index);
-		if (err < 0)
+		/* The lookup returned the free record to use */
+		if (index >= num_access_records)
 			return -ENOSPC;
 
 		rec.invalid = 0;
+		rec.epoch = acl_epoch;
 		rec.type = type;
 		rec.key = key;
 	}
 
 	/* Set the accessable doors */
 	rec.doors = doors;
+	if (!access_record_fits(&rec))
+		return -ERANGE;
 
 	/* If no door is left remove the whole record */
 	if (doors == 0) {
 		rec.type = ACCESS_TYPE_NONE;
 		rec.key  = 0;
+		/* If the next record is unused no probe sequence goes
+		 * through this one, so it can be marked as unused too.
+		 * But if this record has been written more than the next
+		 * one keep it, so that the next insert on this probe
+		 * sequence can use the next record. */
+		next = (index + 1) % num_access_records;
+		if (index_clean)
+			rec.invalid = access_record_is_unused(next) &&
+				access_write_count(index) <=
+				access_write_count(next);
 	}
 
-	return eeprom_set_access_record(index, &rec);
+	eeprom_write_access_record(index, &rec);
+	eeprom_acl_modified();
+	return 0;
 }
 
-void eeprom_remove_all_access(void)
+int8_t eeprom_remove_all_access(void)
 {
-	struct access_record rec;
+#if ACCESS_FINGERPRINTS
 	uint16_t i;
+#endif
 
-	for (i = 0; i < ARRAY_SIZE(config.access); i++) {
-		eeprom_read_block(&rec, &config.access[i], sizeof(rec));
-		if (rec.invalid || rec.type == ACCESS_TYPE_NONE)
-			continue;
+	/* The records from the last epoch must all be invalidated
+	 * before switching back to it. */
+	if (stale_access_records)
+		return -EBUSY;
 
-		rec.type = ACCESS_TYPE_NONE;
-		eeprom_write_block(&rec, &config.access[i], sizeof(rec));
-	}
+	/* Switching to the next epoch makes all the records unused,
+	 * without the table the fingerprints follow the epoch. */
+#if ACCESS_FINGERPRINTS
+	for (i = 0; i < num_access_records; i++)
+		if (access_fingerprints[i] != FINGERPRINT_UNUSED)
+			access_fingerprints[i] = FINGERPRINT_STALE;
+#endif
+	stale_access_records = num_access_records - unused_access_records;
+	free_access_records = num_access_records;
+	acl_hash = 0;
+	acl_epoch = !acl_epoch;
+	acl_generation = (acl_generation + 1) & EEPROM_ACL_GENERATION_MASK;
+	acl_generation_read = 0;
+	eeprom_write_acl_generation();
+
+	/* An empty table is always properly indexed */
+	eeprom_set_index_clean(1);
+
+	/* Invalidate the old records in the background */
+	event_add_prio(&eeprom_write_queue, EEPROM_EVENT_CLEANUP,
+		       EVENT_VAL(NULL), EVENT_PRIO_LOW);
+	return 0;
 }
 
 int8_t eeprom_get_door_config(uint8_t id, struct door_config *cfg)
@@ -151,7 +1034,9 @@ int8_t eeprom_get_door_config(uint8_t id, struct door_config *cfg)
 	if (id >= ARRAY_SIZE(config.door))
 		return -EINVAL;
 
-	eeprom_read_block(cfg, &config.door[id], sizeof(*cfg));
+	eeprom_read(cfg, config.door[id], sizeof(config.door[id]));
+	eeprom_read(&cfg->wiegand_formats, &config.wiegand_formats[id],
+		    sizeof(cfg->wiegand_formats));
 	return 0;
 }
 
@@ -160,6 +1045,8 @@ int8_t eeprom_set_door_config(uint8_t id, const struct door_config *cfg)
 	if (id >= ARRAY_SIZE(config.door))
 		return -EINVAL;
 
-	eeprom_write_block(cfg, &config.door[id], sizeof(*cfg));
+	eeprom_write(cfg, config.door[id], sizeof(config.door[id]));
+	eeprom_write(&cfg->wiegand_formats, &config.wiegand_formats[id],
+		     sizeof(cfg->wiegand_formats));
 	return 0;
 }
@@ -3,30 +3,163 @@
 
 #include "eeprom-types.h"
 
+/* Keep a fingerprint of each access record in RAM to skip most of the
+ * EEPROM reads during a lookup, this use a byte of RAM per record. */
+#ifndef ACCESS_FINGERPRINTS
+#define ACCESS_FINGERPRINTS		1
+#endif
+
+/* Count the writes to each access record since boot, this use a byte
+ * of RAM per record. The counts are not stored, they restart from 0
+ * on each boot. */
+#ifndef ACCESS_BOOT_WRITE_COUNTS
+#define ACCESS_BOOT_WRITE_COUNTS		1
+#endif
+
+/* The index_state byte hold the format of the access records and
+ * if all the records can be found by probing from their hash slot.
+ * Unknown values are handled as a dirty v1 table. */
+#define EEPROM_INDEX_CLEAN	0x4A
+#define EEPROM_INDEX_DIRTY	0xEF
+#define EEPROM_INDEX_V2_CLEAN	0xB5
+#define EEPROM_INDEX_V2_DIRTY	0xBF
+/* The records are being erased to switch to another format */
+#define EEPROM_INDEX_ERASE_V1	0xF1
+#define EEPROM_INDEX_ERASE_V2	0xF2
+
+/* The upper bit of the ACL generation hold the inverted ACL epoch,
+ * so that an erased EEPROM starts with epoch 0. */
+#define EEPROM_ACL_GENERATION_MASK	0x7FFF
+#define EEPROM_ACL_EPOCH_N		0x8000
+
+/* The layout byte is the last byte of the EEPROM, it is written last
+ * when converting from the baseline layout. The baseline used that byte
+ * for the flags of its last access record on the ATmega328, and never
+ * wrote it on the ATmega168. It only wrote flags without the invalid
+ * bit, or left them erased, so it never had this value. */
+#define EEPROM_LAYOUT_MAGIC	0xB4
+
+struct eeprom_state {
+	uint8_t index_state;
+	/* Incremented when the ACL is modified */
+	uint16_t acl_generation;
+	uint8_t layout;
+} PACKED;
+
+/* Compact record format, the key is sign extended to 32 bits
+ * to also allow PIN codes up to 6 digits. */
+struct access_record_v2 {
+	int32_t key     : 26;
+	uint32_t type   : 2;
+	uint32_t invalid: 1;
+	uint32_t epoch  : 1;
+	uint32_t doors  : 2;
+} PACKED;
+
+/* The door configs are stored without the Wiegand formats, so that
+ * the access records start at the same offset as in older firmware. */
+#define DOOR_CONFIG_EEPROM_SIZE		7
+
+/* The Wiegand formats of the doors and the state are at the end */
 #define ACCESS_RECORDS_SIZE \
-	(EEPROM_SIZE - NUM_DOORS * sizeof(struct door_config))
+	(EEPROM_SIZE - NUM_DOORS * (DOOR_CONFIG_EEPROM_SIZE + 1) - \
+	 sizeof(struct eeprom_state))
+
+/* The baseline layout had v1 records up to the end of the EEPROM */
+#define NUM_ACCESS_RECORDS_BASELINE \
+	((EEPROM_SIZE - NUM_DOORS * DOOR_CONFIG_EEPROM_SIZE) / \
+	 sizeof(struct access_record))
 
-#define NUM_ACCESS_RECORDS \
+#define NUM_ACCESS_RECORDS_V1 \
 	(ACCESS_RECORDS_SIZE / sizeof(struct access_record))
 
+#define NUM_ACCESS_RECORDS_V2 \
+	(ACCESS_RECORDS_SIZE / sizeof(struct access_record_v2))
+
+/* Maximum number of records in any format */
+#define NUM_ACCESS_RECORDS	NUM_ACCESS_RECORDS_V2
+
+/* The access records form an open addressed hash table keyed on
+ * (type, key) with linear probing. Records with the invalid bit set
+ * or from an old epoch are unused and terminate a lookup, removed
+ * records are left as ACCESS_TYPE_NONE to keep the probe sequences
+ * intact. Removing all the access just switch to the next epoch,
+ * the old records are then invalidated in the background. */
 struct eeprom_config {
-	struct door_config door[NUM_DOORS];
-	struct access_record access[NUM_ACCESS_RECORDS];
+	uint8_t door[NUM_DOORS][DOOR_CONFIG_EEPROM_SIZE];
+	union {
+		struct access_record v1[NUM_ACCESS_RECORDS_V1];
+		struct access_record_v2 v2[NUM_ACCESS_RECORDS_V2];
+		/* Pad the records to put the state at the end */
+		uint8_t raw[ACCESS_RECORDS_SIZE];
+	} access;
+	uint8_t wiegand_formats[NUM_DOORS];
+	struct eeprom_state state;
 };
 
+/* Writes are queued and done in the background, each completed write
+ * send this event with eeprom_write_queue as source. The value is the
+ * sequence number of the last completed write. */
+#define EEPROM_EVENT_WRITE_DONE	0
+/* Internal event to start the cleanup of the old epoch records */
+#define EEPROM_EVENT_CLEANUP	1
+
+extern struct eeprom_write_queue eeprom_write_queue;
+
+void eeprom_init(void);
+
+/* Get the sequence number of the last queued write */
+uint8_t eeprom_write_seq(void);
+
+/* Check if the write with the given sequence number has completed */
+uint8_t eeprom_write_done(uint8_t seq);
+
+uint8_t eeprom_get_access_format(void);
+
+/* Switch the access records to another format. This erase all the
+ * records, so the host has to upload them again. */
+int8_t eeprom_set_access_format(uint8_t format);
+
+/* Get the number of access records in the current format */
+uint16_t eeprom_get_access_record_count(void);
+
 uint16_t eeprom_get_free_access_record_count(void);
 
+#if ACCESS_BOOT_WRITE_COUNTS
+/* Get the number of writes to a record since boot, saturate at 255.
+ * Writes that don't change the record are not counted. */
+uint8_t eeprom_get_access_boot_write_count(uint16_t id);
+#endif
+
+/* Get the ACL generation, the next modification of the ACL will
+ * increment it. Modifications that happen before the generation
+ * has been read again don't increment it further. */
+uint16_t eeprom_get_acl_generation(void);
+
+/* Get the sum of the digest of all used records, see
+ * eeprom_access_digest() */
+uint16_t eeprom_get_acl_hash(void);
+
 int8_t eeprom_get_access_record(uint16_t id, struct access_record *rec);
 
 int8_t eeprom_set_access_record(uint16_t id, const struct access_record *rec);
 
+/* Get the first used record starting at index id, id is updated
+ * with the index of the returned record. */
+int8_t eeprom_get_next_access_record(uint16_t *id, struct access_record *rec);
+
 int8_t eeprom_get_access(uint8_t type, uint32_t key, uint8_t *doors);
 
 int8_t eeprom_has_access(uint8_t type, uint32_t key, uint8_t door_id);
 
 int8_t eeprom_set_access(uint8_t type, uint32_t key, uint8_t doors);
 
-void eeprom_remove_all_access(void);
+/* Remove all the records by switching to the next epoch. The records
+ * of the old epoch are then invalidated in the background, this take
+ * one byte write (3.4 ms) per record that was used or removed, so up
+ * to 0.9 s on the ATmega328. Fails with -EBUSY until the records of
+ * the previous call have all been invalidated. */
+int8_t eeprom_remove_all_access(void);
 
 int8_t eeprom_get_door_config(uint8_t id, struct door_config *cfg);
 
@@ -41,5 +41,17 @@
 #ifndef ERANGE
 #define	ERANGE		34	/* Math result not representable */
 #endif
+#ifndef ENOSYS
+#define	ENOSYS		38	/* Function not implemented */
+#endif
+#ifndef EPROTO
+#define	EPROTO		71	/* Protocol error */
+#endif
+#ifndef EBADMSG
+#define	EBADMSG		74	/* Not a data message */
+#endif
+#ifndef EOVERFLOW
+#define	EOVERFLOW	75	/* Value too large for defined data type */
+#endif
 
 #endif
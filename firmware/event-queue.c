@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <util/atomic.h>
 
 #include "event-queue.h"
@@ -12,28 +13,73 @@ struct event {
 	struct event *next;
 
 	const void *source;
+	struct event_source_stats *src;
 	uint8_t id;
 	union event_val val;
 };
 
-#define MAX_PENDING_EVENTS 8
-
-static struct event * volatile events;
-static struct event * volatile events_tail;
+/* One FIFO per priority */
+static struct event * volatile events[EVENT_PRIO_COUNT];
+static struct event * volatile events_tail[EVENT_PRIO_COUNT];
 static struct event events_storage[MAX_PENDING_EVENTS];
+/* Events that have been released, and number of events in
+ * the storage that have never been used */
+static struct event *events_free;
+static uint8_t events_storage_used;
+
+/* The handlers are hashed on their source to only go through the
+ * handlers of the event source when dispatching. */
+#define EVENT_HANDLER_BUCKETS 8
+
+static struct event_handler * volatile handlers[EVENT_HANDLER_BUCKETS];
+
+static struct event_queue_stats stats;
+/* Number of reserved slots that are currently unused */
+static uint8_t events_reserved =
+	EVENT_STATS_MAX_SOURCES * EVENT_RESERVED_SLOTS;
+
+_Static_assert(EVENT_SHARED_SLOTS > 0, "The event queue needs shared slots");
+/* Each event takes 11 bytes on the AVR, keep the queue under 1/6
+ * of the RAM */
+_Static_assert(MAX_PENDING_EVENTS <= RAM_SIZE / 64,
+	       "The event queue uses too much RAM");
+
+static struct event_handler * volatile *event_handler_bucket(
+	const void *source)
+{
+	uint16_t s = (uintptr_t)source;
 
-static struct event_handler * volatile handlers;
+	return &handlers[(s ^ (s >> 4)) % EVENT_HANDLER_BUCKETS];
+}
 
-static uint8_t life_gpio;
+/* Find the statistics of a source, the handlers of a source should
+ * be alone in their bucket most of the time. */
+static struct event_source_stats *event_find_source(const void *source)
+{
+	struct event_handler *hdlr;
+
+	for (hdlr = *event_handler_bucket(source); hdlr; hdlr = hdlr->next)
+		if (hdlr->source == source)
+			return &stats.source[hdlr->source_id];
+
+	return NULL;
+}
 
 int8_t event_handler_add(struct event_handler *hdlr)
 {
+	struct event_handler * volatile *bucket;
+
 	if (!hdlr || !hdlr->source || !hdlr->handler)
 		return -EINVAL;
 
+	/* Each source needs its statistics for its reserved slots */
+	if (hdlr->source_id >= ARRAY_SIZE(stats.source))
+		return -ENOSPC;
+
+	bucket = event_handler_bucket(hdlr->source);
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		hdlr->next = handlers;
-		handlers = hdlr;
+		hdlr->next = *bucket;
+		*bucket = hdlr;
 	}
 
 	return 0;
@@ -41,19 +87,21 @@ int8_t event_handler_add(struct event_handler *hdlr)
 
 int8_t event_handler_remove(struct event_handler *hdlr)
 {
+	struct event_handler * volatile *bucket;
 	int8_t ret = -ENOENT;
 
 	if (!hdlr)
 		return -EINVAL;
 
+	bucket = event_handler_bucket(hdlr->source);
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		if (hdlr == handlers) {
-			handlers = hdlr->next;
+		if (hdlr == *bucket) {
+			*bucket = hdlr->next;
 			ret = 0;
-		} else {
+		} else if (*bucket) {
 			struct event_handler *h;
 
-			for (h = handlers ; h->next ; h = h->next)
+			for (h = *bucket ; h->next ; h = h->next)
 				if (h->next == hdlr) {
 					h->next = hdlr->next;
 					ret = 0;
@@ -66,64 +114,151 @@ int8_t event_handler_remove(struct event_handler *hdlr)
 	return ret;
 }
 
-int8_t event_add(const void *source, uint8_t id, union event_val val)
+static void event_free(struct event *ev)
+{
+	if (ev->src && --ev->src->pending < EVENT_RESERVED_SLOTS)
+		events_reserved++;
+	stats.depth--;
+
+	ev->source = NULL;
+	ev->next = events_free;
+	events_free = ev;
+}
+
+static struct event *event_alloc(struct event_source_stats *src)
+{
+	struct event *ev;
+
+	/* Sources can always use their reserved slots,
+	 * the others slots are shared. */
+	if ((!src || src->pending >= EVENT_RESERVED_SLOTS) &&
+	    MAX_PENDING_EVENTS - stats.depth <= events_reserved)
+		return NULL;
+
+	/* Take a released event or a new one from the storage */
+	ev = events_free;
+	if (ev)
+		events_free = ev->next;
+	else if (events_storage_used < ARRAY_SIZE(events_storage))
+		ev = &events_storage[events_storage_used++];
+	if (!ev)
+		return NULL;
+
+	if (src && src->pending++ < EVENT_RESERVED_SLOTS)
+		events_reserved--;
+	stats.depth++;
+#if EVENT_STATS
+	if (stats.depth > stats.max_depth)
+		stats.max_depth = stats.depth;
+	stats.events++;
+#endif
+
+	ev->src = src;
+	return ev;
+}
+
+static struct event *event_find_pending(const void *source, uint8_t id)
+{
+	struct event *ev;
+	uint8_t prio;
+
+	for (prio = 0; prio < EVENT_PRIO_COUNT; prio++)
+		for (ev = events[prio]; ev; ev = ev->next)
+			if (ev->source == source && ev->id == id)
+				return ev;
+
+	return NULL;
+}
+
+static struct event *event_queue(const void *source, uint8_t id,
+				 union event_val val, uint8_t prio)
+{
+	struct event_source_stats *src;
+	struct event *ev;
+
+	src = event_find_source(source);
+	ev = event_alloc(src);
+	if (!ev) {
+#if EVENT_STATS
+		stats.drops++;
+		if (src)
+			src->drops++;
+#endif
+		return NULL;
+	}
+
+	/* Fill the event */
+	ev->next = NULL;
+	ev->source = source;
+	ev->id = id;
+	ev->val = val;
+
+	/* Add it to the tail */
+	if (events_tail[prio])
+		events_tail[prio]->next = ev;
+	else
+		events[prio] = ev;
+	events_tail[prio] = ev;
+
+	return ev;
+}
+
+int8_t event_add_prio(const void *source, uint8_t id, union event_val val,
+		      uint8_t flags)
 {
+	uint8_t prio = flags & EVENT_PRIO_MASK;
 	struct event *ev = NULL;
-	uint8_t i;
 
 	/* The source is mendatory */
-	if (!source)
+	if (!source || prio >= EVENT_PRIO_COUNT)
 		return -EINVAL;
 
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		/* Find a free event in the storage */
-		for (i = 0; i < ARRAY_SIZE(events_storage); i++)
-			if (!events_storage[i].source) {
-				ev = &events_storage[i];
-				break;
-			}
-		if (ev) {
-			/* Fill the event */
-			ev->next = NULL;
-			ev->source = source;
-			ev->id = id;
+		/* Just update the value of a pending event */
+		if (flags & EVENT_COALESCE)
+			ev = event_find_pending(source, id);
+		if (ev)
 			ev->val = val;
-
-			/* Add it to the tail */
-			if (events_tail)
-				events_tail->next = ev;
-			else
-				events = ev;
-			events_tail = ev;
-		}
+		else
+			ev = event_queue(source, id, val, prio);
 	}
 
 	return ev ? 0 : -ENOMEM;
 }
 
+#if EVENT_STATS
+void event_get_stats(struct event_queue_stats *s)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		memcpy(s, &stats, sizeof(*s));
+}
+#endif
+
 int8_t event_remove(const void *source, uint8_t id)
 {
 	struct event *ev, *prev, *next;
+	uint8_t prio;
 
 	/* The source is mendatory */
 	if (!source)
 		return -EINVAL;
 
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		for (ev = events, prev = NULL; ev ; ev = next) {
-			next = ev->next;
-			if (ev->source != source || ev->id != id) {
-				prev = ev;
-				continue;
+		for (prio = 0; prio < EVENT_PRIO_COUNT; prio++) {
+			for (ev = events[prio], prev = NULL; ev ; ev = next) {
+				next = ev->next;
+				if (ev->source != source || ev->id != id) {
+					prev = ev;
+					continue;
+				}
+				if (prev)
+					prev->next = next;
+				else
+					events[prio] = next;
+				if (!next)
+					events_tail[prio] = prev;
+				event_free(ev);
 			}
-			if (prev)
-				prev->next = next;
-			else
-				events = next;
-			if (!next)
-				events_tail = prev;
-			ev->next = NULL;
-			ev->source = NULL;
 		}
 	}
 
@@ -134,7 +269,13 @@ static void event_run_handlers(struct event *ev)
 {
 	static struct event_handler *hdlr;
 
-	for (hdlr = handlers; hdlr ; hdlr = hdlr->next) {
+#if EVENT_STATS
+	if (ev->src)
+		ev->src->events++;
+#endif
+
+	for (hdlr = *event_handler_bucket(ev->source); hdlr ;
+	     hdlr = hdlr->next) {
 		if (hdlr->source != ev->source)
 			continue;
 		if (hdlr->mask && (ev->id & hdlr->mask) != hdlr->id)
@@ -143,48 +284,66 @@ static void event_run_handlers(struct event *ev)
 	}
 }
 
+/* Let the sources post the events that didn't fit in the queue */
+static void event_run_slot_freed(void)
+{
+	struct event_handler *hdlr;
+	uint8_t i;
+
+	for (i = 0; i < EVENT_HANDLER_BUCKETS; i++)
+		for (hdlr = handlers[i]; hdlr; hdlr = hdlr->next)
+			if (hdlr->slot_freed)
+				hdlr->slot_freed();
+}
+
 static void event_loop_run_once(void)
 {
-	struct event *ev;
+	struct event *ev = NULL;
+	uint8_t prio;
 
-	/* Get the list's head */
+	/* Get the head of the highest priority list */
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		if ((ev = events)) {
+		for (prio = 0; prio < EVENT_PRIO_COUNT; prio++) {
+			if (!(ev = events[prio]))
+				continue;
 			/* Remove it from the queue */
-			events = events->next;
-			if (!events)
-				events_tail = NULL;
+			events[prio] = ev->next;
+			if (!ev->next)
+				events_tail[prio] = NULL;
 			ev->next = NULL;
+			break;
 		}
 	}
 
 	/* Run all the handlers */
 	if (ev) {
 		event_run_handlers(ev);
-		ev->source = NULL;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			event_free(ev);
+		event_run_slot_freed();
 	}
 }
 
 void _sleep_prepare(void)
 {
 	timers_sleep();
-	gpio_set_value(life_gpio, 0);
+	gpio_set_value(LIFE_LED_GPIO, 0);
 }
 
 void _sleep_finish(void)
 {
-	gpio_set_value(life_gpio, 1);
+	gpio_set_value(LIFE_LED_GPIO, 1);
 	timers_wakeup();
 }
 
-void event_loop_run(uint8_t gpio)
+void event_loop_run(void)
 {
-	life_gpio = gpio;
-	gpio_direction_output(life_gpio, 1);
+	/* The life LED is a constant to keep the sleep path short */
+	gpio_direction_output(LIFE_LED_GPIO, 1);
 	while (1) {
 		event_loop_run_once();
 		/* Sleep if no event is pending */
-		sleep_if(!events);
+		sleep_if(!stats.depth);
 	}
-	gpio_set_value(life_gpio, 0);
+	gpio_set_value(LIFE_LED_GPIO, 0);
 }
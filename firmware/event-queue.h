@@ -19,26 +19,116 @@ union event_val {
 typedef void (*event_handler_cb)(
 	uint8_t event, union event_val val, void *context);
 
+/* IDs of the sources with handlers, they index the statistics of the
+ * sources and are reported as is by the control commands. */
+#define EVENT_SOURCE_TIMERS		0
+#define EVENT_SOURCE_EEPROM		1
+#define EVENT_SOURCE_CTRL		2
+#define EVENT_SOURCE_READER(door)	(3 + (door))
+#define EVENT_SOURCE_WIEGAND_PULSES	(3 + NUM_DOORS)
+
+/* Number of source IDs, adding a handler with a larger ID fails
+ * with -ENOSPC. */
+#ifndef EVENT_STATS_MAX_SOURCES
+#define EVENT_STATS_MAX_SOURCES (4 + NUM_DOORS)
+#endif
+
+/* Each source with a handler can always queue this many events */
+#define EVENT_RESERVED_SLOTS 1
+
+/* Number of slots shared by all the sources on top of the reserved
+ * ones, this is how many events can burst from a single source. */
+#ifndef EVENT_SHARED_SLOTS
+#define EVENT_SHARED_SLOTS 4
+#endif
+
+#define MAX_PENDING_EVENTS \
+	(EVENT_STATS_MAX_SOURCES * EVENT_RESERVED_SLOTS + EVENT_SHARED_SLOTS)
+
+/* The events are dispatched from the highest priority first,
+ * and in the order they have been added for a given priority. */
+#define EVENT_PRIO_HIGH		0 /* Reader data and access decisions */
+#define EVENT_PRIO_NORMAL	1
+#define EVENT_PRIO_LOW		2 /* Housekeeping and debug */
+#define EVENT_PRIO_COUNT	3
+#define EVENT_PRIO_MASK		0x0F
+
+/* If an event with the same source and id is already pending just
+ * replace its value instead of queueing a new event. */
+#define EVENT_COALESCE		0x80
+
+/* Count the queued, dispatched and dropped events. Without them only
+ * the queue depth and the pending events of each source are kept, as
+ * they are needed for the reserved slots. */
+#ifndef EVENT_STATS
+#define EVENT_STATS 1
+#endif
+
+struct event_source_stats {
+#if EVENT_STATS
+	/* Events dispatched and dropped because the queue was full */
+	uint16_t events;
+	uint16_t drops;
+#endif
+	/* Events currently queued */
+	uint8_t pending;
+};
+
+/* All the counters wrap around */
+struct event_queue_stats {
+#if EVENT_STATS
+	/* Events queued and dropped because the queue was full */
+	uint16_t events;
+	uint16_t drops;
+#endif
+	/* Number of events pending now and at most */
+	uint8_t depth;
+#if EVENT_STATS
+	uint8_t max_depth;
+#endif
+
+	/* Indexed by the source ID */
+	struct event_source_stats source[EVENT_STATS_MAX_SOURCES];
+};
+
 struct event_handler {
 	struct event_handler *next;
 
 	const void *source;
+	/* EVENT_SOURCE_* ID, the same for all the handlers of a source */
+	uint8_t source_id;
 
 	uint8_t id;
 	uint8_t mask;
 
 	event_handler_cb handler;
 	void *context;
+
+	/* Optional, called from the main loop each time an event has
+	 * been freed, to retry posting an event that didn't fit */
+	void (*slot_freed)(void);
 };
 
 int8_t event_handler_add(struct event_handler *hdlr);
 
 int8_t event_handler_remove(struct event_handler *hdlr);
 
-int8_t event_add(const void *source, uint8_t id, union event_val val);
+/* The flags are a priority and optionally EVENT_COALESCE */
+int8_t event_add_prio(const void *source, uint8_t id, union event_val val,
+		      uint8_t flags);
+
+static inline int8_t event_add(const void *source, uint8_t id,
+			       union event_val val)
+{
+	return event_add_prio(source, id, val, EVENT_PRIO_NORMAL);
+}
 
 int8_t event_remove(const void *source, uint8_t id);
 
-void event_loop_run(uint8_t life_gpio);
+#if EVENT_STATS
+void event_get_stats(struct event_queue_stats *stats);
+#endif
+
+void event_loop_run(void);
 
 #endif /* EVENT_QUEUE_H */
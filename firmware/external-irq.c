@@ -8,6 +8,7 @@
  */
 
 #include <stdlib.h>
+#include <avr/pgmspace.h>
 #include "external-irq.h"
 #include "gpio.h"
 
@@ -17,21 +18,58 @@ struct external_irq_handler {
 	external_irq_handler_t handler;
 	/** Context passed to the handler */
 	void *context;
-	/** Trigger type, needed for edge trigger on pin change IRQs */
-	uint8_t trigger;
 };
 
 /** Table of IRQ handler for external interrupts */
 static struct external_irq_handler
 external_irq_handler_ext[EXTERNAL_IRQ_EXT_COUNT];
 
+/** Number of pin change IRQ handlers
+ *
+ * By default each pin has its own handler. The MCU config can set a
+ * lower count to save RAM, the handlers are then allocated at setup
+ * time and setting up more pins fails.
+ */
+#ifndef EXTERNAL_IRQ_PC_HANDLERS
+#define EXTERNAL_IRQ_PC_HANDLERS (EXTERNAL_IRQ_PC_COUNT * 8)
+#endif
+
 /** Table of IRQ handler for pin change interrupts */
 static struct external_irq_handler
-external_irq_handler_pc[EXTERNAL_IRQ_PC_COUNT * 8];
+external_irq_handler_pc[EXTERNAL_IRQ_PC_HANDLERS];
+
+#if EXTERNAL_IRQ_PC_HANDLERS < EXTERNAL_IRQ_PC_COUNT * 8
+/** Handler index + 1 of each pin change IRQ, 0 if not setup yet */
+static uint8_t external_irq_pc_slot[EXTERNAL_IRQ_PC_COUNT * 8];
+
+/** Number of allocated pin change IRQ handlers */
+static uint8_t external_irq_pc_slots;
+
+#define EXTERNAL_IRQ_PC_HANDLER(num) \
+	(&external_irq_handler_pc[external_irq_pc_slot[num] - 1])
+#else
+#define EXTERNAL_IRQ_PC_HANDLER(num) (&external_irq_handler_pc[num])
+#endif
 
 /** State of each port that provides pin change interrupts */
 static uint8_t external_irq_pc_state[EXTERNAL_IRQ_PC_COUNT];
 
+/** Pins of each port that trigger on a rising edge.
+ *
+ * The pin change interrupts trigger on both edges, the edge filtering
+ * is done in software. To keep the ISR short the trigger of each pin
+ * is turned into these masks at setup time.
+ */
+static uint8_t external_irq_pc_rising[EXTERNAL_IRQ_PC_COUNT];
+
+/** Pins of each port that trigger on a falling edge. */
+static uint8_t external_irq_pc_falling[EXTERNAL_IRQ_PC_COUNT];
+
+/** Index of the lowest bit set in a nibble */
+static const uint8_t external_irq_pc_first_bit[16] PROGMEM = {
+	0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+};
+
 /** List of the ports associated to each pin change interrupts.
  *
  * Each entry is a pointer to the PINx register of the port.
@@ -39,10 +77,10 @@ static uint8_t external_irq_pc_state[EXTERNAL_IRQ_PC_COUNT];
 extern volatile uint8_t * const external_irq_pc_pin[];
 
 /** List of the GPIOs associated to each pin change interrupts. */
-extern const uint8_t external_irq_gpio_pc[];
+extern const uint8_t external_irq_gpio_pc[] PROGMEM;
 
 /** List of the GPIOs associated to each external interrupts. */
-extern const uint8_t external_irq_gpio_ext[];
+extern const uint8_t external_irq_gpio_ext[] PROGMEM;
 
 uint8_t external_irq_from_gpio(uint8_t gpio)
 {
@@ -51,11 +89,11 @@ uint8_t external_irq_from_gpio(uint8_t gpio)
 	gpio = GPIO_SET_POLARITY(gpio, GPIO_HIGH_ACTIVE);
 
 	for (i = 0; i < EXTERNAL_IRQ_PC_COUNT * 8; i++)
-		if (external_irq_gpio_pc[i] == gpio)
+		if (pgm_read_byte(&external_irq_gpio_pc[i]) == gpio)
 			return IRQ(PC, i);
 
 	for (i = 0; i < EXTERNAL_IRQ_EXT_COUNT; i++)
-		if (external_irq_gpio_ext[i] == gpio)
+		if (pgm_read_byte(&external_irq_gpio_ext[i]) == gpio)
 			return IRQ(EXT, i);
 
 	return 0;
@@ -68,11 +106,11 @@ uint8_t external_irq_get_gpio(uint8_t irq)
 	switch(IRQ_TYPE(irq)) {
 	case IRQ_TYPE_EXT:
 		if (num < EXTERNAL_IRQ_EXT_COUNT)
-			return external_irq_gpio_ext[num];
+			return pgm_read_byte(&external_irq_gpio_ext[num]);
 		break;
 	case IRQ_TYPE_PC:
 		if (num < EXTERNAL_IRQ_PC_COUNT * 8)
-			return external_irq_gpio_pc[num];
+			return pgm_read_byte(&external_irq_gpio_pc[num]);
 		break;
 	}
 	return 0;
@@ -96,13 +134,42 @@ static int8_t external_irq_setup_ext(uint8_t irq_num, uint8_t trigger)
 	return 0;
 }
 
+/** Get the handler of a pin change IRQ, allocate it if needed */
+static struct external_irq_handler *external_irq_get_pc_handler(
+	uint8_t irq_num)
+{
+#if EXTERNAL_IRQ_PC_HANDLERS < EXTERNAL_IRQ_PC_COUNT * 8
+	if (!external_irq_pc_slot[irq_num]) {
+		if (external_irq_pc_slots >= EXTERNAL_IRQ_PC_HANDLERS)
+			return NULL;
+		external_irq_pc_slot[irq_num] = ++external_irq_pc_slots;
+	}
+#endif
+	return EXTERNAL_IRQ_PC_HANDLER(irq_num);
+}
+
 /** Setup a pin change IRQ */
 static int8_t external_irq_setup_pc(uint8_t irq_num, uint8_t trigger)
 {
+	uint8_t port = irq_num >> 3;
+	uint8_t bit = _BV(irq_num & 7);
+
 	/* Level trigger are not supported */
 	if (trigger == IRQ_TRIGGER_LOW_LEVEL)
 		return -1;
-	PCICR |= _BV(irq_num >> 3);
+
+	/* The IRQ is masked, so the ISR doesn't use the edge masks */
+	if (trigger == IRQ_TRIGGER_FALLING_EDGE)
+		external_irq_pc_rising[port] &= ~bit;
+	else
+		external_irq_pc_rising[port] |= bit;
+
+	if (trigger == IRQ_TRIGGER_RAISING_EDGE)
+		external_irq_pc_falling[port] &= ~bit;
+	else
+		external_irq_pc_falling[port] |= bit;
+
+	PCICR |= _BV(port);
 	return 0;
 }
 
@@ -115,7 +182,7 @@ int8_t external_irq_setup(uint8_t irq, uint8_t pull, uint8_t trigger,
 
 	/* Get the GPIO and configure it as input */
 	gpio = external_irq_get_gpio(irq);
-	if (!gpio)
+	if (!gpio || !handler)
 		return -1;
 
 	err = gpio_direction_input(gpio, pull);
@@ -138,7 +205,9 @@ int8_t external_irq_setup(uint8_t irq, uint8_t pull, uint8_t trigger,
 		err = external_irq_setup_ext(irq_num, trigger);
 		break;
 	case IRQ_TYPE_PC:
-		dispatch = &external_irq_handler_pc[irq_num];
+		dispatch = external_irq_get_pc_handler(irq_num);
+		if (!dispatch)
+			return -1;
 		err = external_irq_setup_pc(irq_num, trigger);
 		break;
 	default:
@@ -150,7 +219,6 @@ int8_t external_irq_setup(uint8_t irq, uint8_t pull, uint8_t trigger,
 
 	dispatch->handler = handler;
 	dispatch->context = context;
-	dispatch->trigger = trigger;
 
 	return 0;
 }
@@ -302,34 +370,53 @@ EXT_INT_HANDLER(7)
 #endif /* EXTERNAL_IRQ_EXT_COUNT > 0 */
 
 #if EXTERNAL_IRQ_PC_COUNT > 0
-/** Generic ISR for pin change interrupts */
-static void external_irq_pc_handler(uint8_t port,
-				volatile uint8_t *mask_reg)
+/** Generic ISR for pin change interrupts
+ *
+ * This is inlined in each ISR to have a constant port number. Only the
+ * pins that changed and whose trigger match the new state are walked.
+ *
+ * Cycles from the vector entry to reti, without the handler bodies but
+ * with their icall and ret, for PCINT0 on the ATmega168 with 2 doors:
+ *
+ *                            8 pins loop   this version
+ *   one pin, 1 handler           751           178
+ *   two pins, 2 handlers         822           244
+ *   masked pin, no handler       668           107
+ *
+ * These were counted with clang -Os listings run through an instruction
+ * level simulator using the datasheet cycle counts, avr-gcc will give
+ * somewhat different numbers. About 72 cycles are the save and restore
+ * of the call clobbered registers, needed to call the handlers.
+ */
+static inline __attribute__((always_inline))
+void external_irq_pc_handler(uint8_t port, volatile uint8_t *mask_reg)
 {
-	uint8_t last_state = external_irq_pc_state[port];
 	uint8_t state = *external_irq_pc_pin[port];
-	uint8_t mask = *mask_reg;
-	uint8_t pin;
-
-	for (pin = 0 ; pin < 8 ; pin += 1) {
-		struct external_irq_handler *irq =
-			&external_irq_handler_pc[(port << 3) + pin];
-		/* Skip if the IRQ is masked or there is no handler */
-		if (!(mask & _BV(pin)) || !irq->handler)
-			continue;
-		/* Skip if this pin state didn't change */
-		if ((state & _BV(pin)) == (last_state & _BV(pin)))
-			continue;
-		/* Call the handler if there is a trigger */
-		if (irq->trigger == IRQ_TRIGGER_BOTH_EDGE ||
-			(irq->trigger == IRQ_TRIGGER_FALLING_EDGE &&
-				(state & _BV(pin)) == 0) ||
-			(irq->trigger == IRQ_TRIGGER_RAISING_EDGE &&
-				(state & _BV(pin)) != 0))
-			irq->handler((state >> pin) & 1, irq->context);
-	}
+	uint8_t changed = state ^ external_irq_pc_state[port];
+	uint8_t pending;
 
 	external_irq_pc_state[port] = state;
+
+	pending = (state & external_irq_pc_rising[port]) |
+		(~state & external_irq_pc_falling[port]);
+	pending &= changed & *mask_reg;
+
+	while (pending) {
+		struct external_irq_handler *irq;
+		uint8_t bit = pending & -pending;
+		uint8_t pin;
+
+		if (pending & 0xF)
+			pin = pgm_read_byte(
+				&external_irq_pc_first_bit[pending & 0xF]);
+		else
+			pin = 4 + pgm_read_byte(
+				&external_irq_pc_first_bit[pending >> 4]);
+
+		irq = EXTERNAL_IRQ_PC_HANDLER((port << 3) + pin);
+		pending ^= bit;
+		irq->handler(!!(state & bit), irq->context);
+	}
 }
 
 /** Helper to define an ISR for pin change interrupts */
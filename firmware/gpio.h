@@ -18,6 +18,8 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
+#include <avr/io.h>
 
 /** \defgroup GPIOPort GPIO Ports
  * @{
@@ -89,6 +91,84 @@
 #define GPIO_SET_POLARITY(gpio, pol) \
 	(((gpio) & 0x7F) | (((pol) & 1) << 7))
 
+/** Struct to access the GPIO registers */
+struct gpio_regs {
+	volatile uint8_t pin;
+	volatile uint8_t ddr;
+	volatile uint8_t port;
+};
+
+/** Helper macro to get the GPIO register of a port */
+#define GPIO_REGS(n)	((struct gpio_regs *)&PIN ## n)
+
+/** Get the register to use for a GPIO
+ *
+ * \param gpio GPIO ID
+ * \return A pointer to the registers, or NULL on error.
+ *
+ * This is always inlined so that it reduces to a constant when the
+ * GPIO ID is known at compile time.
+ */
+static inline __attribute__((always_inline))
+struct gpio_regs *gpio_get_regs(uint8_t gpio)
+{
+	switch(GPIO_PORT(gpio)) {
+	case GPIO_PORT_A:
+#ifdef PORTA
+		return GPIO_REGS(A);
+#else
+		return NULL;
+#endif
+	case GPIO_PORT_B:
+#ifdef PORTB
+		return GPIO_REGS(B);
+#else
+		return NULL;
+#endif
+	case GPIO_PORT_C:
+#ifdef PORTC
+		return GPIO_REGS(C);
+#else
+		return NULL;
+#endif
+	case GPIO_PORT_D:
+#ifdef PORTD
+		return GPIO_REGS(D);
+#else
+		return NULL;
+#endif
+	case GPIO_PORT_E:
+#ifdef PORTE
+		return GPIO_REGS(E);
+#else
+		return NULL;
+#endif
+	case GPIO_PORT_F:
+#ifdef PORTF
+		return GPIO_REGS(F);
+#else
+		return NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/** Check if a GPIO ID is a valid compile time constant
+ *
+ * The accessors below use this to select a direct register access,
+ * which compile to single sbi/cbi/sbis instructions, instead of
+ * decoding the GPIO ID at runtime.
+ */
+#define gpio_is_const(gpio) \
+	(__builtin_constant_p(gpio) && gpio_get_regs(gpio) != NULL)
+
+int8_t __gpio_direction_input(uint8_t gpio, uint8_t pull);
+int8_t __gpio_direction_output(uint8_t gpio, uint8_t val);
+int8_t __gpio_get_value(uint8_t gpio);
+void __gpio_set_value(uint8_t gpio, uint8_t state);
+void __gpio_open_collector_set_value(uint8_t gpio, uint8_t state);
+
 /** Check if a GPIO is valid
  *
  * \param gpio GPIO ID
@@ -102,7 +182,19 @@ int8_t gpio_is_valid(uint8_t gpio);
  * \param pull Enable the internal pull-up
  * \return 0 on success, a negative value otherwise
  */
-int8_t gpio_direction_input(uint8_t gpio, uint8_t pull);
+static inline __attribute__((always_inline))
+int8_t gpio_direction_input(uint8_t gpio, uint8_t pull)
+{
+	if (!gpio_is_const(gpio))
+		return __gpio_direction_input(gpio, pull);
+
+	if (pull)
+		gpio_get_regs(gpio)->port |= _BV(GPIO_PIN(gpio));
+	else
+		gpio_get_regs(gpio)->port &= ~_BV(GPIO_PIN(gpio));
+	gpio_get_regs(gpio)->ddr &= ~_BV(GPIO_PIN(gpio));
+	return 0;
+}
 
 /** Configure a GPIO as output
  *
@@ -110,21 +202,53 @@ int8_t gpio_direction_input(uint8_t gpio, uint8_t pull);
  * \param val Initial value
  * \return 0 on success, a negative value otherwise
  */
-int8_t gpio_direction_output(uint8_t gpio, uint8_t val);
+static inline __attribute__((always_inline))
+int8_t gpio_direction_output(uint8_t gpio, uint8_t val)
+{
+	if (!gpio_is_const(gpio))
+		return __gpio_direction_output(gpio, val);
+
+	if ((!!val) ^ GPIO_POLARITY(gpio))
+		gpio_get_regs(gpio)->port |= _BV(GPIO_PIN(gpio));
+	else
+		gpio_get_regs(gpio)->port &= ~_BV(GPIO_PIN(gpio));
+	gpio_get_regs(gpio)->ddr |= _BV(GPIO_PIN(gpio));
+	return 0;
+}
 
 /** Get the current value of an input GPIO
  *
  * \param gpio GPIO ID
  * \return the pin state
  */
-int8_t gpio_get_value(uint8_t gpio);
+static inline __attribute__((always_inline))
+int8_t gpio_get_value(uint8_t gpio)
+{
+	if (!gpio_is_const(gpio))
+		return __gpio_get_value(gpio);
+
+	return !!(gpio_get_regs(gpio)->pin & _BV(GPIO_PIN(gpio))) ^
+		GPIO_POLARITY(gpio);
+}
 
 /** Set the value of an output GPIO
  *
  * \param gpio GPIO ID
  * \param state The new pin state
  */
-void gpio_set_value(uint8_t gpio, uint8_t state);
+static inline __attribute__((always_inline))
+void gpio_set_value(uint8_t gpio, uint8_t state)
+{
+	if (!gpio_is_const(gpio)) {
+		__gpio_set_value(gpio, state);
+		return;
+	}
+
+	if ((!!state) ^ GPIO_POLARITY(gpio))
+		gpio_get_regs(gpio)->port |= _BV(GPIO_PIN(gpio));
+	else
+		gpio_get_regs(gpio)->port &= ~_BV(GPIO_PIN(gpio));
+}
 
 /** Configure a GPIO as open collector
  *
@@ -144,7 +268,19 @@ int8_t gpio_open_collector(uint8_t gpio, uint8_t val);
  * \param gpio GPIO ID
  * \param state The new pin state
  */
-void gpio_open_collector_set_value(uint8_t gpio, uint8_t state);
+static inline __attribute__((always_inline))
+void gpio_open_collector_set_value(uint8_t gpio, uint8_t state)
+{
+	if (!gpio_is_const(gpio)) {
+		__gpio_open_collector_set_value(gpio, state);
+		return;
+	}
+
+	if ((!!state) ^ GPIO_POLARITY(gpio))
+		gpio_get_regs(gpio)->ddr &= ~_BV(GPIO_PIN(gpio));
+	else
+		gpio_get_regs(gpio)->ddr |= _BV(GPIO_PIN(gpio));
+}
 
 /**@}*/
 #endif /* GPIO_H */
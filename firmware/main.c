@@ -55,6 +55,8 @@ static int init_doors(void)
 		if (eeprom_cfg.open_time > 0 &&
 		    eeprom_cfg.open_time < INT16_MAX / 2)
 			cfg.open_time = eeprom_cfg.open_time;
+		if (eeprom_cfg.wiegand_formats != 0xFF)
+			cfg.wiegand_formats = eeprom_cfg.wiegand_formats;
 
 		err = door_ctrl_init(&dc[i], &cfg);
 		if (err)
@@ -64,17 +66,29 @@ static int init_doors(void)
 	return err;
 }
 
-int main(void)
+/* Not inlined to not keep the stack used by the init on the
+ * stack of the main loop */
+static __attribute__((noinline)) int8_t init(void)
 {
 	int8_t err;
 
 	clock_prescale_set(clock_div_1);
 	timers_init();
+	eeprom_init();
 
 	err = ctrl_cmd_init();
 	if (!err)
 		err = init_doors();
 
+	return err;
+}
+
+int main(void)
+{
+	int8_t err;
+
+	err = init();
+
 	/* On error turn on the life LED and sleep forwever */
 	if (err) {
 		gpio_direction_output(LIFE_LED_GPIO, 1);
@@ -83,7 +97,7 @@ int main(void)
 
 	sei();
 	ctrl_send_event(CTRL_EVENT_STARTED, NULL, 0);
-	event_loop_run(LIFE_LED_GPIO);
+	event_loop_run();
 
 	return 0;
 }
@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "gpio.h"
 
 volatile uint8_t * const external_irq_pc_pin[] = {
@@ -7,7 +8,7 @@ volatile uint8_t * const external_irq_pc_pin[] = {
 	&PIND,
 };
 
-const uint8_t external_irq_gpio_pc[] = {
+const uint8_t external_irq_gpio_pc[] PROGMEM = {
 	GPIO(B, 0, HIGH_ACTIVE),
 	GPIO(B, 1, HIGH_ACTIVE),
 	GPIO(B, 2, HIGH_ACTIVE),
@@ -34,7 +35,7 @@ const uint8_t external_irq_gpio_pc[] = {
 	GPIO(D, 7, HIGH_ACTIVE),
 };
 
-const uint8_t external_irq_gpio_ext[] = {
+const uint8_t external_irq_gpio_ext[] PROGMEM = {
 	GPIO(D, 2, HIGH_ACTIVE),
 	GPIO(D, 3, HIGH_ACTIVE),
 };
@@ -1,6 +1,28 @@
+/* RAM */
+#define RAM_SIZE		1024
+
 /* EEPROM */
 #define EEPROM_SIZE		512
 
 /* UART */
 #define UART_RX_GPIO		GPIO(D, 0, HIGH_ACTIVE)
 #define UART_TX_GPIO		GPIO(D, 1, HIGH_ACTIVE)
+
+/* Only 1K of RAM, leave out the optional buffers and statistics */
+/* The ATmega168 doesn't get the Wiegand pulses ring: even a ring of 8
+ * pulses per reader takes 48 more bytes with its event and goes over
+ * the RAM budget. The words are framed, decoded and ended on their
+ * timeout in the interrupt handlers instead, which makes them longer
+ * and delays the other interrupts. */
+#define WIEGAND_PULSES_SIZE	0
+#define WIEGAND_READER_STATS	0
+#define ACCESS_BOOT_WRITE_COUNTS	0
+#define ACCESS_FINGERPRINTS	0
+#define CTRL_MSG_MAX_PAYLOAD_SIZE	32
+#define EEPROM_WRITE_QUEUE_SIZE	2
+#define EVENT_STATS		0
+#define EVENT_SHARED_SLOTS	2
+/* No Wiegand pulses source without the ring */
+#define EVENT_STATS_MAX_SOURCES	(3 + NUM_DOORS)
+/* The Wiegand data, status and open button of each door */
+#define EXTERNAL_IRQ_PC_HANDLERS	(4 * NUM_DOORS)
@@ -1,3 +1,6 @@
+/* RAM */
+#define RAM_SIZE		2048
+
 /* EEPROM */
 #define EEPROM_SIZE		1024
 
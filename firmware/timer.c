@@ -8,8 +8,12 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "timer.h"
+#include "event-queue.h"
 
 #if   F_CPU == 1000000
 #define TIMER_SHIFT 0
@@ -27,20 +31,42 @@
 
 #define TIMER_TICK (1000 << TIMER_SHIFT)
 
-/** Queue of the pending timer, ordered by timeout */
-static struct timer * volatile pending;
+/** Longest time between two interrupts, in milliseconds. It must stay
+ * well below the counter period to not miss a wrap around. */
+#define TIMER_MAX_STEP (0x8000 / TIMER_TICK)
+/** Minimum distance, in counts, between the counter and the next
+ * compare to make sure that it is written before the match. */
+#define TIMER_MIN_LEAD 16
+
+/** Heap of the pending timers, the next timer to expire is first */
+static struct timer *timers_heap[MAX_TIMERS];
+static uint8_t volatile num_pending;
+/** Expired timers waiting for their callback to run in the main loop */
+static struct timer *expired_timers;
+static struct timer *expired_timers_tail;
+/** Set when the event queue was full when the first timer expired */
+static uint8_t expired_timers_unposted;
+static struct event_handler expired_timers_handler;
+static void timers_post_expired(void);
+
+/** Set while the timer is stopped because the CPU sleeps */
+static uint8_t volatile timers_stopped;
+
 /** Current time in milliseconds */
-static uint16_t volatile now;
+static uint32_t volatile now;
+/** Counter value at the start of the current millisecond */
+static uint16_t now_cnt;
 
 #if TIMER_SHIFT > 0
 /** Extension of the timer to deliver 16 bits nano seconds */
 static uint8_t cnt_extension;
 /** Interrupts mask */
-#define TIMER_IRQ_MASK (_BV(OCIE1A) | _BV(OCIE1B) | _BV(TOIE1))
+#define TIMER_IRQ_MASK (_BV(OCIE1A) | _BV(TOIE1))
 #else
-#define TIMER_IRQ_MASK (_BV(OCIE1A) | _BV(OCIE1B))
+#define TIMER_IRQ_MASK (_BV(OCIE1A))
 #endif
 
+_Static_assert(MAX_TIMERS < 128, "Too many timers for the heap indexes");
 
 /** Mask the timer interrupt */
 static void timer_mask_irq(void)
@@ -54,138 +80,457 @@ static void timer_unmask_irq(void)
 	TIMSK1 |= TIMER_IRQ_MASK;
 }
 
+/** Mask the timer interrupt and return its previous state, this allow
+ * using the timers from other interrupt handlers. */
+static uint8_t timer_save_irq(void)
+{
+	uint8_t mask = TIMSK1 & TIMER_IRQ_MASK;
+
+	TIMSK1 &= ~(TIMER_IRQ_MASK);
+	return mask;
+}
+
+/** Restore the timer interrupt state */
+static void timer_restore_irq(uint8_t mask)
+{
+	TIMSK1 |= mask;
+}
+
+/** The 16 bits registers share a temporary register, so their access
+ * must not be interrupted by another interrupt handler using them. */
+static uint16_t timer_read_cnt(void)
+{
+	uint16_t cnt;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		cnt = TCNT1;
+	return cnt;
+}
+
+static void timer_write_compare(uint16_t cnt)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		OCR1A = cnt;
+}
+
+/** Restart the timer if it has been stopped for sleeping, this must
+ * be done before scheduling from an interrupt handler that woke up
+ * the CPU. The returned mask must be passed to timer_restore_irq(). */
+static uint8_t timer_save_irq_and_resume(void)
+{
+	uint8_t mask;
+
+	/* The main loop might get interrupted by a handler that restart
+	 * the timer, so check and clear the flag atomically. */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		mask = timer_save_irq();
+		if (timers_stopped) {
+			/* The time doesn't run while the timer is stopped */
+			timers_stopped = 0;
+			now_cnt = timer_read_cnt();
+			TIFR1 = _BV(OCF1A);
+			mask = TIMER_IRQ_MASK;
+		}
+	}
+
+	return mask;
+}
+
+/** Catch up the time with the counter, must be called with
+ * the timer IRQ masked */
+static void timer_update_now(void)
+{
+	uint16_t cnt;
+
+	if (timers_stopped)
+		return;
+
+	cnt = timer_read_cnt();
+	while ((uint16_t)(cnt - now_cnt) >= TIMER_TICK) {
+		now_cnt += TIMER_TICK;
+		now += 1;
+	}
+}
+
+#if TIMER_STATS
+static struct timer_stats stats;
+
+/** Account the lateness of a timer, must be called with
+ * the timer IRQ masked */
+static void timer_stats_lateness(struct timer *t)
+{
+	uint32_t late;
+	uint8_t bucket = 0;
+
+	timer_update_now();
+	late = (now - t->when) * 1000 +
+		((uint16_t)(timer_read_cnt() - now_cnt) >> TIMER_SHIFT);
+	if (late > 0xFFFF)
+		late = 0xFFFF;
+
+	while (late >> (7 + bucket) &&
+	       bucket < TIMER_STATS_LATENESS_BUCKETS - 1)
+		bucket++;
+	if (stats.lateness[bucket] < 0xFFFF)
+		stats.lateness[bucket]++;
+	if (late > stats.max_lateness)
+		stats.max_lateness = late;
+}
+
+/** Run a timer callback and account its lateness and duration */
+static void timer_run_callback(struct timer *t)
+{
+	uint16_t start, duration;
+	uint8_t irq;
+
+	irq = timer_save_irq();
+	timer_stats_lateness(t);
+	timer_restore_irq(irq);
+
+	start = timer_get_time_us();
+	t->callback(t->context);
+	duration = timer_get_time_us() - start;
+
+	irq = timer_save_irq();
+	if (duration > stats.max_callback)
+		stats.max_callback = duration;
+	timer_restore_irq(irq);
+}
+
+int8_t timer_get_stats(struct timer_stats *s, uint8_t reset)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(s, &stats, sizeof(*s));
+		if (reset)
+			memset(&stats, 0, sizeof(stats));
+	}
+
+	return 0;
+}
+#else
+static void timer_run_callback(struct timer *t)
+{
+	t->callback(t->context);
+}
+#endif
+
+static void timers_run_expired(uint8_t event, union event_val val,
+			       void *context)
+{
+	struct timer *t;
+	uint8_t irq, run = 0;
+
+	do {
+		/* Take the first expired timer */
+		irq = timer_save_irq();
+		t = expired_timers;
+		if (t) {
+			expired_timers = t->next;
+			if (!expired_timers)
+				expired_timers_tail = NULL;
+			t->next = NULL;
+			t->queued = 0;
+			/* Skip it if it has been rescheduled in the meantime */
+			run = t->expired;
+			t->expired = 0;
+		} else {
+			/* Everything ran, no need to retry posting */
+			expired_timers_unposted = 0;
+		}
+		timer_restore_irq(irq);
+
+		if (t && run)
+			timer_run_callback(t);
+	} while (t);
+}
+
 void timers_init(void)
 {
 	/* Setup the timer to run every micro second, this allow code that
-	 * need it access to a high precision timer. However we only want
-	 * to run the timers every 1 millisecond. We use the 3 comparators
-	 * to match every 1000 ticks.
+	 * need it access to a high precision timer. The comparator is
+	 * then set on the next timer deadline, rounded to a millisecond.
 	 */
-	OCR1A = TIMER_TICK;
-	OCR1B = OCR1A + TIMER_TICK;
+	now_cnt = 0;
+	OCR1A = TIMER_MAX_STEP * TIMER_TICK;
 	TCCR1A = 0;
 #if F_CPU < 8000000 /* Under 8MHz don't use a prescaler */
 	TCCR1B = _BV(CS10);
 #else /* Above 8MHz use a 1/8 prescaler */
 	TCCR1B = _BV(CS11);
 #endif
+	/* Run the expired timers from the main loop */
+	expired_timers_handler.source = &expired_timers;
+	expired_timers_handler.source_id = EVENT_SOURCE_TIMERS;
+	expired_timers_handler.handler = timers_run_expired;
+	expired_timers_handler.slot_freed = timers_post_expired;
+	event_handler_add(&expired_timers_handler);
+
 	/* Enable the timer interrupt */
 	timer_unmask_irq();
 }
 
 void timers_sleep(void)
 {
-	if (!pending)
+	if (!num_pending) {
 		timer_mask_irq();
+		timers_stopped = 1;
+	}
+}
+
+/** Set the comparator on the next deadline, must be called with
+ * the timer IRQ masked */
+static void timer_program_next(void)
+{
+	uint16_t step = TIMER_MAX_STEP;
+	uint16_t cnt;
+
+	if (num_pending) {
+		uint32_t when = timers_heap[0]->when;
+
+		if (time_before_eq(when, now))
+			step = 1;
+		else if (when - now < step)
+			step = when - now;
+	}
+
+	/* Make sure that the compare is still ahead of the counter,
+	 * if we are late the next tick will catch up. */
+	cnt = now_cnt + step * TIMER_TICK;
+	while ((int16_t)(cnt - timer_read_cnt()) < TIMER_MIN_LEAD)
+		cnt += TIMER_TICK;
+	timer_write_compare(cnt);
 }
 
 void timers_wakeup(void)
 {
-	if (!pending)
-		timer_unmask_irq();
+	uint8_t irq;
+
+	/* An interrupt handler might already have restarted the timer */
+	if (!timers_stopped)
+		return;
+
+	irq = timer_save_irq_and_resume();
+	timer_program_next();
+	timer_restore_irq(irq);
 }
 
-/** Insert a timer in the pending queue */
-static void timer_queue_pending(struct timer *timer)
+static void timer_heap_set(uint8_t index, struct timer *t)
 {
-	struct timer *t;
+	timers_heap[index] = t;
+	t->index = index;
+}
 
-	/* Mark the timer as pending */
-	timer->pending = 1;
+/** Move a timer up in the heap until its parent expires before it */
+static void timer_sift_up(struct timer *t)
+{
+	uint8_t i = t->index, parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (time_before_eq(timers_heap[parent]->when, t->when))
+			break;
+		timer_heap_set(i, timers_heap[parent]);
+		i = parent;
+	}
+	timer_heap_set(i, t);
+}
 
-	/* Add it at the head of the queue */
-	if (pending == NULL || time_before(timer->when, pending->when)) {
-		timer->next = pending;
-		pending = timer;
+/** Move a timer down in the heap until its children expire after it */
+static void timer_sift_down(struct timer *t)
+{
+	uint8_t i = t->index, child;
+
+	while ((child = 2 * i + 1) < num_pending) {
+		if (child + 1 < num_pending &&
+		    time_before(timers_heap[child + 1]->when,
+				timers_heap[child]->when))
+			child++;
+		if (time_before_eq(t->when, timers_heap[child]->when))
+			break;
+		timer_heap_set(i, timers_heap[child]);
+		i = child;
+	}
+	timer_heap_set(i, t);
+}
+
+/** Insert a timer in the pending heap, or move it if already pending */
+static void timer_queue_pending(struct timer *timer)
+{
+	/* Rescheduling just has to restore the heap order */
+	if (timer->pending) {
+		timer_sift_up(timer);
+		timer_sift_down(timer);
 		return;
 	}
 
-	/* Find the insert point for the new timer */
-	for (t = pending;
-	     t->next && time_before_eq(t->next->when, timer->when);
-	     t = t->next)
-		/* NOOP */;
+	if (num_pending >= MAX_TIMERS)
+		return;
 
-	/* Insert the new timer in the list */
-	timer->next = t->next;
-	t->next = timer;
+	/* Mark the timer as pending and add it at the bottom */
+	timer->pending = 1;
+	timer->index = num_pending++;
+#if TIMER_STATS
+	if (num_pending > stats.max_pending)
+		stats.max_pending = num_pending;
+#endif
+	timer_sift_up(timer);
 }
 
-/** Remove a timer from the pending queue */
+/** Remove a timer from the pending heap */
 static void timer_dequeue_pending(struct timer *old)
 {
+	struct timer *last;
+
 	/* Check if the timer is pending */
 	if (!old->pending)
 		return;
 
-	/* Detach from the pending list */
-	if (pending == old) {
-		pending = old->next;
-	} else {
-		struct timer *t;
-		for (t = pending; t; t = t->next)
-			if (t->next == old) {
-				t->next = old->next;
-				break;
-			}
-	}
-	old->next = NULL;
 	/* Clear the pending flag */
 	old->pending = 0;
+
+	/* Move the last timer in the hole */
+	last = timers_heap[--num_pending];
+	if (last != old) {
+		timer_heap_set(old->index, last);
+		timer_sift_up(last);
+		timer_sift_down(last);
+	}
 }
 
-void timer_init(struct timer *t, timer_cb_t callback, void *context)
+void timer_init(struct timer *t, timer_cb_t callback, void *context,
+		uint8_t flags)
 {
 	if (t == NULL)
 		return;
 
 	t->next = NULL;
 	t->when = 0;
+	t->isr = !!(flags & TIMER_FLAG_ISR);
+	t->pending = 0;
+	t->queued = 0;
+	t->expired = 0;
 	t->callback = callback;
 	t->context = context;
 }
 
-void timer_schedule(struct timer *t, uint16_t when)
+/** Wake up the main loop to run the expired timers, must be called
+ * with the timer IRQ masked */
+static void timer_post_expired(void)
+{
+	expired_timers_unposted = event_add_prio(
+		&expired_timers, 0, EVENT_VAL(NULL), EVENT_PRIO_HIGH) != 0;
+}
+
+/** Retry waking up the main loop for the expired timers, in case
+ * the event queue was full when a timer expired */
+static void timers_post_expired(void)
+{
+	uint8_t irq;
+
+	if (!expired_timers_unposted)
+		return;
+
+	irq = timer_save_irq();
+	if (expired_timers_unposted)
+		timer_post_expired();
+	timer_restore_irq(irq);
+}
+
+/** Add a timer to the expired list and wake up the main loop */
+static void timer_queue_expired(struct timer *t)
+{
+	t->expired = 1;
+	if (t->queued)
+		return;
+
+	t->queued = 1;
+	if (expired_timers_tail) {
+		expired_timers_tail->next = t;
+	} else {
+		expired_timers = t;
+		timer_post_expired();
+	}
+	expired_timers_tail = t;
+}
+
+/** Queue a timer and update the comparator if it is the next one */
+static void timer_queue(struct timer *t)
 {
+	t->expired = 0;
+	timer_queue_pending(t);
+	if (timers_heap[0] == t)
+		timer_program_next();
+}
+
+void timer_schedule(struct timer *t, uint32_t when)
+{
+	uint8_t irq;
+
 	if (t == NULL)
 		return;
 
-	timer_mask_irq();
+	irq = timer_save_irq_and_resume();
+	timer_update_now();
 	t->when = when;
-	timer_dequeue_pending(t);
-	timer_queue_pending(t);
-	timer_unmask_irq();
+	timer_queue(t);
+	timer_restore_irq(irq);
 }
 
-void timer_schedule_in(struct timer *t, uint16_t delay)
+void timer_schedule_in(struct timer *t, uint32_t delay)
 {
+	uint8_t irq;
+
 	if (t == NULL)
 		return;
 
-	timer_mask_irq();
+	irq = timer_save_irq_and_resume();
+	timer_update_now();
 	t->when = now + delay;
+	timer_queue(t);
+	timer_restore_irq(irq);
+}
+
+void timer_expire(struct timer *t)
+{
+	uint8_t irq;
+
+	if (t == NULL)
+		return;
+
+	irq = timer_save_irq();
 	timer_dequeue_pending(t);
-	timer_queue_pending(t);
-	timer_unmask_irq();
+	timer_update_now();
+	t->when = now;
+	if (!t->isr)
+		timer_queue_expired(t);
+	timer_restore_irq(irq);
+
+	if (t->isr)
+		timer_run_callback(t);
 }
 
 void timer_deschedule(struct timer *t)
 {
+	uint8_t irq;
+
 	if (t == NULL)
 		return;
 
-	timer_mask_irq();
+	irq = timer_save_irq();
+	t->expired = 0;
 	timer_dequeue_pending(t);
-	timer_unmask_irq();
+	timer_restore_irq(irq);
 }
 
-uint16_t timer_get_time(void)
+uint32_t timer_get_time(void)
 {
-	uint16_t n;
+	uint32_t n;
+	uint8_t irq;
 
-	timer_mask_irq();
+	irq = timer_save_irq();
+	timer_update_now();
 	n = now;
-	timer_unmask_irq();
+	timer_restore_irq(irq);
 
 	return n;
 }
@@ -193,16 +538,22 @@ uint16_t timer_get_time(void)
 uint16_t timer_get_time_us(void)
 {
 	uint16_t n;
-
-	/* Mask the IRQ to make sure the TEMP register is not trashed
-	 * during the read */
-	timer_mask_irq();
-	n = TCNT1;
 #if TIMER_SHIFT > 0
+	uint8_t ext;
+
+	/* This is also used from interrupt handlers, so the overflow
+	 * interrupt might be pending and the extension not updated yet. */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		n = TCNT1;
+		ext = cnt_extension;
+		if ((TIFR1 & _BV(TOV1)) && n < 0x8000)
+			ext++;
+	}
 	n >>= TIMER_SHIFT;
-	n |= ((uint16_t)cnt_extension) << (16 - TIMER_SHIFT);
+	n |= ((uint16_t)ext) << (16 - TIMER_SHIFT);
+#else
+	n = timer_read_cnt();
 #endif
-	timer_unmask_irq();
 
 	return n;
 }
@@ -211,30 +562,41 @@ static void timers_tick(void)
 {
 	struct timer *t;
 
-	now += 1;
+	timer_update_now();
 
-	while ((t = pending) && time_before_eq(t->when, now)) {
-		/* Detach the timer from the pending list */
-		pending = t->next;
-		t->next = NULL;
-		t->pending = 0;
+	while (num_pending && time_before_eq(timers_heap[0]->when, now)) {
+		/* Detach the timer from the pending heap */
+		t = timers_heap[0];
+		timer_dequeue_pending(t);
 
-		/* Run the callback */
-		t->callback(t->context);
+		/* Run the callback now or from the main loop */
+		if (t->isr)
+			timer_run_callback(t);
+		else
+			timer_queue_expired(t);
 	}
+
+	timer_program_next();
 }
 
+#if TIMER_STATS
 ISR(TIMER1_COMPA_vect)
 {
-	OCR1B = OCR1A + TIMER_TICK;
+	uint16_t start = timer_get_time_us();
+	uint16_t duration;
+
 	timers_tick();
-}
 
-ISR(TIMER1_COMPB_vect)
+	duration = timer_get_time_us() - start;
+	if (duration > stats.max_isr)
+		stats.max_isr = duration;
+}
+#else
+ISR(TIMER1_COMPA_vect)
 {
-	OCR1A = OCR1B + TIMER_TICK;
 	timers_tick();
 }
+#endif
 
 #if TIMER_SHIFT > 0
 ISR(TIMER1_OVF_vect)
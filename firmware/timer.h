@@ -18,30 +18,72 @@
  */
 #include <stdint.h>
 
+/** Maximum number of timers that can be pending at the same time,
+ * boards with more devices can override it.
+ */
+#ifndef MAX_TIMERS
+#define MAX_TIMERS 16
+#endif
+
+/** Run the callback directly in the timer interrupt handler instead
+ * of the main loop. It should only be used for short callbacks.
+ */
+#define TIMER_FLAG_ISR 0x01
+
+/** Number of buckets in the lateness histogram */
+#define TIMER_STATS_LATENESS_BUCKETS 8
+
+/** Timers statistics, only available if built with TIMER_STATS */
+struct timer_stats {
+    /** Number of callbacks by lateness, bucket n counts the callbacks
+     * that ran less than (128 << n) us after their deadline, the last
+     * bucket counts all the others. The counters saturate. */
+    uint16_t lateness[TIMER_STATS_LATENESS_BUCKETS];
+    /** Longest lateness, in microseconds */
+    uint16_t max_lateness;
+    /** Longest timer interrupt and callback, in microseconds */
+    uint16_t max_isr;
+    uint16_t max_callback;
+    /** Largest number of pending timers */
+    uint8_t max_pending;
+};
+
 /** Type for the timer callbacks */
 typedef void (*timer_cb_t)(void *context);
 
 /** struct to hold a timer state */
 struct timer {
-    /** Pointer to the next timer in the pending list */
-    struct timer * volatile  next;
+    /** Pointer to the next timer in the list of expired timers */
+    struct timer *next;
     /** Callback to call when the timer expires */
     timer_cb_t callback;
     /** Context pointer for the callback */
     void *context;
     /** When the callback should be scheduled */
-    uint16_t when;
-    /** Set if the timer is in the pending list */
+    uint32_t when;
+    /** Position of the timer in the pending heap */
+    uint8_t index;
+    /** Set if the timer has been created with TIMER_FLAG_ISR */
+    uint8_t isr : 1;
+    /** Set if the timer is in the pending heap */
     uint8_t volatile pending : 1;
+    /** Set if the timer is in the list of expired timers */
+    uint8_t volatile queued : 1;
+    /** Set if the callback should still be run from the main loop */
+    uint8_t volatile expired : 1;
 };
 
-/** Return true if time a is after time b */
-#define time_after(a, b) ((int16_t)((b) - (a)) < 0)
+/** Return true if time a is after time b
+ *
+ * The time is 32 bits and wraps around after 49 days, so times can
+ * only be compared if they are less than 24 days apart.
+ */
+#define time_after(a, b) ((int32_t)((b) - (a)) < 0)
 /** Return true if time a is before time b */
 #define time_before(a, b) time_after(b, a)
 
 /** Return true if time a is equal to time b or after. */
-#define time_after_eq(a, b) ((int16_t)((a) - (b)) >= 0)
+#define time_after_eq(a, b) ((int32_t)((a) - (b)) >= 0)
 /** Return true if time a is equal to time b or before. */
 #define time_before_eq(a, b) time_after_eq(b, a)
 
@@ -61,10 +103,13 @@ void timers_sleep(void);
 void timers_wakeup(void);
 
 /** Get the current time in milliseconds
+ *
+ * The time is monotonic, but it doesn't run while the device sleeps
+ * without any pending timer. It can be read from interrupt handlers.
  *
  * \return The current time in milliseconds
  */
-uint16_t timer_get_time(void);
+uint32_t timer_get_time(void);
 
 /** Get the current time in microseconds
  *
@@ -73,29 +118,42 @@ uint16_t timer_get_time(void);
 uint16_t timer_get_time_us(void);
 
 /** Init a timer object with the given callback and context
+ *
+ * By default the callback is run from the main loop, unless
+ * TIMER_FLAG_ISR is set.
  *
  * \param t The timer to setup
  * \param callback The callback to call when the timer expires
  * \param context The context pointer to pass to the callback
+ * \param flags The timer flags
  */
-void timer_init(struct timer *t, timer_cb_t callback, void *context);
+void timer_init(struct timer *t, timer_cb_t callback, void *context,
+		uint8_t flags);
 
 /** Schedule a timer to run at the given time
  *
  * \param t The timer to schedule
  * \param when The time when the timer should run, in milliseconds.
  */
-void timer_schedule(struct timer *t, uint16_t when);
+void timer_schedule(struct timer *t, uint32_t when);
 
 /** Schedule a timer to run after a delay
  *
  * \param t The timer to schedule
  * \param delay The delay, in milliseconds, after which should run.
  *
- * Note that because the timer is only 16 bits, only delay up to
- * 32 seconds make sense.
+ * Delays up to 24 days are supported.
+ */
+void timer_schedule_in(struct timer *t, uint32_t delay);
+
+/** Make a timer expire now
+ *
+ * The callback is run as if the timer just expired, from the main
+ * loop or directly for timers with TIMER_FLAG_ISR.
+ *
+ * \param t The timer to expire
  */
-void timer_schedule_in(struct timer *t, uint16_t delay);
+void timer_expire(struct timer *t);
 
 /** Deschedule a timer
  *
@@ -103,5 +161,15 @@ void timer_schedule_in(struct timer *t, uint16_t delay);
  */
 void timer_deschedule(struct timer *t);
 
+#if TIMER_STATS
+/** Get the timers statistics
+ *
+ * \param stats The statistics output
+ * \param reset Clear the statistics after reading them
+ * \return 0
+ */
+int8_t timer_get_stats(struct timer_stats *stats, uint8_t reset);
+#endif
+
 /**@}*/
 #endif /* TIMER_H */
@@ -1,13 +1,24 @@
 #include <string.h>
 #include <errno.h>
+#include <avr/pgmspace.h>
 #include "trigger.h"
 #include "gpio.h"
 
+/* The sequences are in the program memory, except for the single
+ * step of trigger_start() */
+static uint16_t trigger_seq_step(const struct trigger *tr, uint8_t pos)
+{
+	if (tr->seq == &tr->single_seq)
+		return tr->single_seq;
+	return pgm_read_word(&tr->seq[pos]);
+}
+
 static void trigger_on_timeout(void *context)
 {
 	struct trigger *tr = context;
 
-	while (tr->seq_pos < tr->seq_len && !tr->seq[tr->seq_pos])
+	while (tr->seq_pos < tr->seq_len &&
+	       !trigger_seq_step(tr, tr->seq_pos))
 		tr->seq_pos++;
 
 	if (tr->seq_pos >= tr->seq_len) {
@@ -20,7 +31,7 @@ static void trigger_on_timeout(void *context)
 	/* Play the next step */
 	if (tr->gpio)
 		gpio_set_value(tr->gpio, !(tr->seq_pos & 1));
-	timer_schedule_in(&tr->timer, tr->seq[tr->seq_pos]);
+	timer_schedule_in(&tr->timer, trigger_seq_step(tr, tr->seq_pos));
 	tr->seq_pos++;
 }
 
@@ -70,7 +81,7 @@ int8_t trigger_init(struct trigger *tr, uint8_t gpio,
 	tr->on_finished = on_finished;
 	tr->on_finished_context = on_finished_context;
 
-	timer_init(&tr->timer, trigger_on_timeout, tr);
+	timer_init(&tr->timer, trigger_on_timeout, tr, 0);
 
 	if (gpio)
 		return gpio_direction_output(gpio, 0);
@@ -25,6 +25,7 @@ void trigger_set(struct trigger *tr, uint8_t value);
 
 void trigger_start(struct trigger *tr, uint16_t duration);
 
+/* The sequence must be in the program memory */
 int8_t trigger_start_seq(struct trigger *tr, const uint16_t *seq,
 			 uint8_t seq_len);
 
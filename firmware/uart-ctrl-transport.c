@@ -105,36 +105,56 @@ static void uart_ctrl_transport_on_recv(uint8_t byte, void *context)
 	}
 }
 
-static void uart_ctrl_transport_on_sent(void *context)
+/* Get the byte at pos in the unescaped message, without the start byte */
+static uint8_t uart_ctrl_transport_tx_byte(struct ctrl_transport *ctrl,
+					   uint8_t pos)
 {
-	struct ctrl_transport *ctrl = context;
+	if (pos == 0)
+		return ctrl->tx_type;
+	if (pos == 1)
+		return ctrl->tx_length;
+	pos -= 2;
+	if (pos < ctrl->tx_length)
+		return ctrl->tx_payload[pos];
+	return ((uint8_t *)&ctrl->tx_crc)[pos - ctrl->tx_length];
+}
 
-	if (ctrl->state == UART_CTRL_TRANSPORT_SEND_REPLY)
-		ctrl->state = UART_CTRL_TRANSPORT_SYNC;
+static void uart_ctrl_transport_on_sent(void *context);
 
-	ctrl->sending = 0;
+/* Escape the next bytes of the message in the output buffer and send
+ * them, len is the number of bytes already in the buffer. */
+static int8_t uart_ctrl_transport_send_chunk(struct ctrl_transport *ctrl,
+					     uint8_t len)
+{
+	uint8_t end = ctrl->tx_length + 4;
+	uint8_t c;
+
+	while (ctrl->tx_pos < end && len < sizeof(ctrl->outbuf) - 1) {
+		c = uart_ctrl_transport_tx_byte(ctrl, ctrl->tx_pos++);
+		if (c == UART_CTRL_TRANSPORT_START ||
+		    c == UART_CTRL_TRANSPORT_ESC) {
+			ctrl->outbuf[len++] = UART_CTRL_TRANSPORT_ESC;
+			c = UART_CTRL_TRANSPORT_ESCAPE(c);
+		}
+		ctrl->outbuf[len++] = c;
+	}
+
+	return uart_send(ctrl->outbuf, len, uart_ctrl_transport_on_sent, ctrl);
 }
 
-static int8_t uart_ctrl_transport_write_outbuf(struct ctrl_transport *ctrl,
-				     uint16_t *crc, uint8_t c)
+static void uart_ctrl_transport_on_sent(void *context)
 {
-	uint8_t esc = (c == UART_CTRL_TRANSPORT_START ||
-		       c == UART_CTRL_TRANSPORT_ESC);
-
-	if (ctrl->pos + esc >= sizeof(ctrl->outbuf))
-		return -E2BIG;
+	struct ctrl_transport *ctrl = context;
 
-	if (esc) {
-		ctrl->outbuf[ctrl->pos++] = UART_CTRL_TRANSPORT_ESC;
-		ctrl->outbuf[ctrl->pos++] = UART_CTRL_TRANSPORT_ESCAPE(c);
-	} else {
-		ctrl->outbuf[ctrl->pos++] = c;
-	}
+	/* Send the rest of the message */
+	if (ctrl->tx_pos < ctrl->tx_length + 4 &&
+	    !uart_ctrl_transport_send_chunk(ctrl, 0))
+		return;
 
-	if (crc)
-		*crc = uart_ctrl_transport_crc(*crc, c);
+	if (ctrl->state == UART_CTRL_TRANSPORT_SEND_REPLY)
+		ctrl->state = UART_CTRL_TRANSPORT_SYNC;
 
-	return 0;
+	ctrl->sending = 0;
 }
 
 static int8_t ctrl_transport_write(
@@ -148,31 +168,21 @@ static int8_t ctrl_transport_write(
 	if (length > sizeof(ctrl->msg.payload))
 		return -E2BIG;
 
-	/* Initialize the state and write the start byte */
-	ctrl->pos = 0;
-	ctrl->outbuf[ctrl->pos++] = UART_CTRL_TRANSPORT_START;
-	/* Write the packet header */
-	uart_ctrl_transport_write_outbuf(ctrl, &crc, type);
-	uart_ctrl_transport_write_outbuf(ctrl, &crc, length);
-	/* Then the payload */
-	for (i = 0; i < length; i++) {
-		err = uart_ctrl_transport_write_outbuf(
-			ctrl, &crc, ((uint8_t *)payload)[i]);
-		if (err)
-			return err;
-	}
-	/* Finally the CRC */
-	for (i = 0; i < sizeof(crc); i++) {
-		err = uart_ctrl_transport_write_outbuf(
-			ctrl, NULL, ((uint8_t *)&crc)[i]);
-		if (err)
-			return err;
-	}
+	ctrl->tx_type = type;
+	ctrl->tx_length = length;
+	ctrl->tx_payload = payload;
+	ctrl->tx_pos = 0;
 
-	/* Then send the whole message */
+	/* The CRC covers the header and the payload */
+	for (i = 0; i < length + 2; i++)
+		crc = uart_ctrl_transport_crc(
+			crc, uart_ctrl_transport_tx_byte(ctrl, i));
+	ctrl->tx_crc = crc;
+
+	/* Write the start byte and send the first chunk */
+	ctrl->outbuf[0] = UART_CTRL_TRANSPORT_START;
 	ctrl->sending = 1;
-	err = uart_send(ctrl->outbuf, ctrl->pos,
-			uart_ctrl_transport_on_sent, ctrl);
+	err = uart_ctrl_transport_send_chunk(ctrl, 1);
 	if (err)
 		ctrl->sending = 0;
 
@@ -188,13 +198,20 @@ int8_t ctrl_transport_reply(struct ctrl_transport *ctrl, uint8_t type,
 	if (ctrl->state != UART_CTRL_TRANSPORT_WAIT_FOR_REPLY)
 		return -EINVAL;
 
+	if (length > sizeof(ctrl->msg.payload))
+		return -E2BIG;
+
 	/* Wait for any message that is beeing sent to be finished */
 	sleep_while(ctrl->sending);
 
+	/* The received message is not needed anymore and incoming data
+	 * is ignored until the reply is sent, so it holds the reply. */
+	memmove(ctrl->msg.payload, payload, length);
+
 	/* Set the next state */
 	ctrl->state = UART_CTRL_TRANSPORT_SEND_REPLY;
 	/* And write it out */
-	err = ctrl_transport_write(ctrl, type, payload, length);
+	err = ctrl_transport_write(ctrl, type, ctrl->msg.payload, length);
 	if (err)
 		ctrl->state = UART_CTRL_TRANSPORT_SYNC;
 
@@ -205,13 +222,19 @@ int8_t ctrl_transport_reply(struct ctrl_transport *ctrl, uint8_t type,
 int8_t ctrl_transport_send_event(struct ctrl_transport *ctrl, uint8_t type,
 				 const void *payload, uint8_t length)
 {
+	int8_t err;
+
 	/* Only allow sending events */
 	if (type < CTRL_EVENT_BASE || type == CTRL_CMD_ERROR)
 		return -EINVAL;
 
 	/* Wait for any currently sent message to be finished */
 	sleep_while(ctrl->sending);
-	return ctrl_transport_write(ctrl, type, payload, length);
+	err = ctrl_transport_write(ctrl, type, payload, length);
+	/* The payload is sent from the caller buffer */
+	if (!err)
+		sleep_while(ctrl->sending);
+	return err;
 }
 
 int8_t ctrl_transport_init(struct ctrl_transport *ctrl)
@@ -27,7 +27,14 @@ struct ctrl_transport {
 	uint16_t msg_crc;
 
 	struct ctrl_msg msg;
-	uint8_t outbuf[1 + sizeof(struct ctrl_msg) * 2];
+
+	/* The message being sent is escaped a chunk at a time */
+	uint8_t tx_type;
+	uint8_t tx_length;
+	uint8_t tx_pos;
+	uint16_t tx_crc;
+	const uint8_t *tx_payload;
+	uint8_t outbuf[8];
 };
 
 #endif /* UART_CTRL_TRANSPORT_H */
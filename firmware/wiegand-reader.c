@@ -1,17 +1,141 @@
 #include <string.h>
 #include <errno.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include "wiegand-reader.h"
 #include "external-irq.h"
 #include "event-queue.h"
 #include "gpio.h"
 
 /* Timeout to trigger reading the bits */
-#define WORD_TIMEOUT 10
+#define WORD_TIMEOUT WIEGAND_WORD_TIMEOUT
+#define WORD_TIMEOUT_US (WORD_TIMEOUT * 1000U)
+
+/* The pulses are timed with 16 bits microseconds */
+_Static_assert(WORD_TIMEOUT > 0 && WORD_TIMEOUT <= 65,
+	       "The word timeout must be between 1 and 65 ms");
+
+/* The specification gives 20 to 100us pulses at least 200us apart,
+ * leave some margin for the interrupt latency and slow readers. */
+#define PULSE_MIN_WIDTH_US	5
+#define PULSE_MAX_WIDTH_US	1000
+#define PULSE_MIN_INTERVAL_US	150
+
+/* Set in word_err once the word has been decoded early */
+#define WORD_DECODED		1
+
+_Static_assert((WIEGAND_PULSES_SIZE & (WIEGAND_PULSES_SIZE - 1)) == 0,
+	       "The pulses ring size must be a power of 2");
+_Static_assert(WIEGAND_PULSES_SIZE <= 128,
+	       "The pulses ring indexes are 8 bits");
+
+static struct wiegand_reader *wiegand_readers;
+#if WIEGAND_PULSES_SIZE
+/* All the readers share a single event to process their pulses */
+static uint8_t volatile wiegand_pulses_queued;
+static struct event_handler wiegand_pulses_handler;
+#endif
+
+#define WORD_SIZE (WIEGAND_MAX_BITS / 8)
+
+struct wiegand_parity {
+	/* Bits covered, including the parity bit itself */
+	uint8_t mask[WORD_SIZE];
+	uint8_t odd;
+};
+
+#define WIEGAND_MAX_PARITY 3
+
+/* The fields are given as their first bit and length, the
+ * unused parity checks have an empty mask and always pass. */
+struct wiegand_format {
+	uint8_t num_bits;
+	struct wiegand_parity parity[WIEGAND_MAX_PARITY];
+	uint8_t facility_start;
+	uint8_t facility_bits;
+	uint8_t card_start;
+	uint8_t card_bits;
+};
+
+/* Build the masks from 40 bits constants, bit 0 of the word is the MSB */
+_Static_assert(WIEGAND_MAX_BITS == 40, "The word masks are 40 bits");
+
+#define WORD_BITS(from, to) \
+	(((1ULL << ((to) - (from) + 1)) - 1) << (WIEGAND_MAX_BITS - 1 - (to)))
+#define WORD_BIT(n)		WORD_BITS(n, n)
+/* Bits that are not 1 or not 0 modulo 3 */
+#define WORD_NOT_MOD3_1		0xB6DB6DB6DBULL
+#define WORD_NOT_MOD3_0		0x6DB6DB6DB6ULL
+
+#define WORD_MASK(m) {					\
+		(uint8_t)((m) >> 32), (uint8_t)((m) >> 24),	\
+		(uint8_t)((m) >> 16), (uint8_t)((m) >> 8),	\
+		(uint8_t)(m)					\
+	}
 
-static inline uint8_t get_bit(uint8_t *data, uint8_t idx)
-{
-	return (data[idx >> 3] >> (idx & 7)) & 1;
-}
+#define EVEN_PARITY(m)	{ .mask = WORD_MASK(m), .odd = 0 }
+#define ODD_PARITY(m)	{ .mask = WORD_MASK(m), .odd = 1 }
+
+static const struct wiegand_format wiegand_formats[] PROGMEM = {
+	[WIEGAND_FORMAT_H10301] = {
+		.num_bits = 26,
+		.parity = {
+			EVEN_PARITY(WORD_BITS(0, 12)),
+			ODD_PARITY(WORD_BITS(13, 25)),
+		},
+		.facility_start = 1,
+		.facility_bits = 8,
+		.card_start = 9,
+		.card_bits = 16,
+	},
+	[WIEGAND_FORMAT_H10306] = {
+		.num_bits = 34,
+		.parity = {
+			EVEN_PARITY(WORD_BITS(0, 16)),
+			ODD_PARITY(WORD_BITS(17, 33)),
+		},
+		.facility_start = 1,
+		.facility_bits = 16,
+		.card_start = 17,
+		.card_bits = 16,
+	},
+	[WIEGAND_FORMAT_C1000_35] = {
+		.num_bits = 35,
+		.parity = {
+			EVEN_PARITY(WORD_BIT(1) |
+				    (WORD_BITS(2, 33) & WORD_NOT_MOD3_1)),
+			ODD_PARITY(WORD_BIT(34) |
+				   (WORD_BITS(1, 32) & WORD_NOT_MOD3_0)),
+			ODD_PARITY(WORD_BITS(0, 34)),
+		},
+		.facility_start = 2,
+		.facility_bits = 12,
+		.card_start = 14,
+		.card_bits = 20,
+	},
+	/* The facility and card number take 35 bits, only the cards with
+	 * a facility code under 8192 fit in the 32 bits keys. The others
+	 * are rejected rather than truncated, as different cards would
+	 * get the same key. */
+	[WIEGAND_FORMAT_H10304] = {
+		.num_bits = 37,
+		.parity = {
+			EVEN_PARITY(WORD_BITS(0, 18)),
+			ODD_PARITY(WORD_BITS(18, 36)),
+		},
+		.facility_start = 1,
+		.facility_bits = 16,
+		.card_start = 17,
+		.card_bits = 19,
+	},
+};
+
+_Static_assert(ARRAY_SIZE(wiegand_formats) == WIEGAND_FORMAT_COUNT,
+	       "Missing Wiegand format");
+
+static const uint8_t nibble_parity[16] PROGMEM = {
+	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+};
 
 static inline void set_bit(uint8_t *data, uint8_t idx, uint8_t val)
 {
@@ -21,136 +145,418 @@ static inline void set_bit(uint8_t *data, uint8_t idx, uint8_t val)
 		data[idx >> 3] &= ~(1 << (idx & 7));
 }
 
-static uint8_t even_parity(uint8_t *data, uint8_t from, uint8_t to)
+static inline void set_word_bit(uint8_t *word, uint8_t idx, uint8_t val)
+{
+	if (val)
+		word[idx >> 3] |= 0x80 >> (idx & 7);
+	else
+		word[idx >> 3] &= ~(0x80 >> (idx & 7));
+}
+
+/* The mask is in the program memory */
+static uint8_t word_parity(const uint8_t *bits, const uint8_t *mask)
 {
-	uint8_t p;
+	uint8_t i, p = 0;
 
-	for (p = 0; from <= to; from++)
-		p += get_bit(data, from);
+	/* The parity of the bytes is the parity of their XOR */
+	for (i = 0; i < WORD_SIZE; i++)
+		p ^= bits[i] & pgm_read_byte(&mask[i]);
 
-	return p & 1;
+	return pgm_read_byte(&nibble_parity[(p ^ (p >> 4)) & 0xF]);
 }
 
-static uint8_t odd_parity(uint8_t *data, uint8_t from, uint8_t to)
+static uint32_t word_get_field(const uint8_t *bits, uint8_t start,
+			       uint8_t len)
 {
-	return !even_parity(data, from, to);
+	uint8_t i = start >> 3;
+	uint8_t n = 8 - (start & 7);
+	uint32_t val;
+
+	/* Start with the end of the first byte */
+	val = bits[i++] & (0xFF >> (start & 7));
+
+	/* Then add whole bytes, and only the needed bits of the last one */
+	while (n < len) {
+		if (len - n >= 8) {
+			val = (val << 8) | bits[i++];
+			n += 8;
+		} else {
+			val = (val << (len - n)) | (bits[i] >> (8 - (len - n)));
+			n = len;
+		}
+	}
+
+	return val >> (n - len);
 }
 
 static void wiegand_reader_event(struct wiegand_reader *wr,
 				    uint8_t event, uint32_t val)
 {
-	event_add(wr, event, EVENT_VAL(val));
+	/* Reader data must not wait behind the housekeeping */
+	event_add_prio(wr, event, EVENT_VAL(val), EVENT_PRIO_HIGH);
+}
+
+/* A disconnected or noisy reader can raise errors much faster than
+ * the main loop handle them, only keep the last one. */
+static void wiegand_reader_error(struct wiegand_reader *wr, int8_t err)
+{
+#if WIEGAND_READER_STATS
+	wr->stats.last_error_time = timer_get_time();
+	wr->stats.last_error = err;
+#endif
+	event_add_prio(wr, WIEGAND_READER_ERROR, EVENT_INT(err),
+		       EVENT_PRIO_HIGH | EVENT_COALESCE);
+}
+
+static int8_t wiegand_reader_process_key(uint8_t key,
+					 uint8_t *event, uint32_t *val)
+{
+	if (key > WIEGAND_KEY_B)
+		return -EBADMSG;
+
+	*event = WIEGAND_READER_EVENT_KEY;
+	*val = key;
+	return 0;
+}
+
+static int8_t wiegand_reader_process_card(
+	const uint8_t *bits, uint8_t num_bits, uint8_t formats,
+	uint8_t *event, uint32_t *val)
+{
+	/* Read the format in place, this can run in the interrupt
+	 * handlers and a copy would take 23 bytes of stack. */
+	const struct wiegand_format *fmt;
+	int8_t err = -EINVAL;
+	uint8_t i, p, card_bits;
+	uint32_t facility;
+
+	for (i = 0; i < ARRAY_SIZE(wiegand_formats); i++) {
+		fmt = &wiegand_formats[i];
+		if (!(formats & BIT(i)) ||
+		    pgm_read_byte(&fmt->num_bits) != num_bits)
+			continue;
+
+		for (p = 0; p < ARRAY_SIZE(fmt->parity); p++)
+			if (word_parity(bits, fmt->parity[p].mask) !=
+			    pgm_read_byte(&fmt->parity[p].odd))
+				break;
+		/* Another format might have the same length */
+		if (p < ARRAY_SIZE(fmt->parity)) {
+			err = -EBADMSG;
+			continue;
+		}
+
+		card_bits = pgm_read_byte(&fmt->card_bits);
+		facility = word_get_field(bits,
+					  pgm_read_byte(&fmt->facility_start),
+					  pgm_read_byte(&fmt->facility_bits));
+		/* The facility code must fit in the bits left */
+		if (facility >> (32 - card_bits)) {
+			err = -ERANGE;
+			continue;
+		}
+
+		*event = WIEGAND_READER_EVENT_CARD;
+		*val = (facility << card_bits) |
+			word_get_field(bits, pgm_read_byte(&fmt->card_start),
+				       card_bits);
+		return 0;
+	}
+
+	return err;
+}
+
+static int8_t wiegand_reader_decode(const uint8_t *bits, uint8_t num_bits,
+				    uint8_t formats,
+				    uint8_t *event, uint32_t *val)
+{
+	switch(num_bits) {
+	case 4:
+		return wiegand_reader_process_key(bits[0] >> 4, event, val);
+	case 8:
+		/* The second nibble is the complement of the key */
+		if ((((bits[0] >> 4) ^ bits[0]) & 0xF) != 0xF)
+			return -EBADMSG;
+		return wiegand_reader_process_key(bits[0] >> 4, event, val);
+	default:
+		return wiegand_reader_process_card(bits, num_bits, formats,
+						   event, val);
+	}
+}
+
+#if WIEGAND_READER_STATS
+static void stats_inc(uint16_t *counter)
+{
+	if (*counter < UINT16_MAX)
+		(*counter)++;
 }
 
-static int8_t wiegand_reader_process_4bits_code(struct wiegand_reader *wr)
+static uint8_t wiegand_stats_words_index(uint8_t num_bits)
 {
-	uint8_t key = 0;
 	uint8_t i;
 
-	/* Reverse the bits order */
-	for (i = 0; i < 4; i++) {
-		key <<= 1;
-		if (get_bit(&wr->bits[0], i))
-			key |= 1;
+	if (num_bits == 4)
+		return WIEGAND_STATS_WORDS_KEY4;
+	if (num_bits == 8)
+		return WIEGAND_STATS_WORDS_KEY8;
+	for (i = 0; i < ARRAY_SIZE(wiegand_formats); i++)
+		if (pgm_read_byte(&wiegand_formats[i].num_bits) == num_bits)
+			return WIEGAND_STATS_WORDS_FORMAT(i);
+	return WIEGAND_STATS_WORDS_OTHER;
+}
+
+static void wiegand_reader_account_word(struct wiegand_reader *wr,
+					int8_t err)
+{
+	struct wiegand_reader_stats *stats = &wr->stats;
+
+	stats_inc(&stats->words[wiegand_stats_words_index(wr->num_bits)]);
 
+	switch (err) {
+	case -EBADMSG:
+		stats_inc(&stats->parity_errors);
+		break;
+	case -EINVAL:
+	case -ERANGE:
+		stats_inc(&stats->unsupported);
+		break;
+	case -EPROTO:
+		stats_inc(&stats->pulse_errors);
+		break;
+	case -EOVERFLOW:
+		stats_inc(&stats->overflows);
+		break;
 	}
+}
 
-	if (key > WIEGAND_KEY_B)
-		return -EINVAL;
+#define WIEGAND_STATS_INC(wr, counter)	stats_inc(&(wr)->stats.counter)
+#else
+static void wiegand_reader_account_word(struct wiegand_reader *wr,
+					int8_t err)
+{
+}
 
-	wiegand_reader_event(wr, WIEGAND_READER_EVENT_KEY, key);
-	return 0;
+#define WIEGAND_STATS_INC(wr, counter)	do {} while (0)
+#endif
+
+static void wiegand_reader_reset_word(struct wiegand_reader *wr)
+{
+	wr->num_bits = 0;
+	wr->word_err = 0;
+	timer_deschedule(&wr->word_timeout);
 }
 
-static int8_t wiegand_reader_process_8bits_code(struct wiegand_reader *wr)
+/* Decode the current word. A word completed early might still be the
+ * start of a longer word, so it is only kept if it could be decoded.
+ * The rest of an early decoded word is then dropped, and reported as
+ * an overflow as the decoded card might have been the wrong one. */
+static void wiegand_reader_end_word(struct wiegand_reader *wr, uint8_t early)
 {
-	/* Check the data validity */
-	if ((wr->bits[0] & 0xF) != ~(wr->bits[0] >> 4))
-		return -EINVAL;
+	uint8_t event;
+	uint32_t val;
+	int8_t err;
 
-	return wiegand_reader_process_4bits_code(wr);
+	err = wr->word_err;
+	if (err == WORD_DECODED) {
+		err = wr->num_bits > wr->early_bits ? -EOVERFLOW : 0;
+		wiegand_reader_reset_word(wr);
+		if (err)
+			wiegand_reader_error(wr, err);
+		return;
+	}
+	if (!err && wr->num_bits > WIEGAND_MAX_BITS)
+		err = -EOVERFLOW;
+	if (!err)
+		err = wiegand_reader_decode(wr->bits, wr->num_bits,
+					    wr->formats, &event, &val);
+	if (early && err)
+		return;
+
+	wiegand_reader_account_word(wr, err);
+	/* Keep counting the bits until the end of the word */
+	if (early)
+		wr->word_err = WORD_DECODED;
+	else
+		wiegand_reader_reset_word(wr);
+
+	if (err)
+		wiegand_reader_error(wr, err);
+	else
+		wiegand_reader_event(wr, event, val);
 }
 
-static int8_t wiegand_reader_process_26bits_code(struct wiegand_reader *wr)
+static void wiegand_reader_process_pulse(struct wiegand_reader *wr,
+					 uint8_t pulse)
 {
-	uint32_t card;
-	uint8_t parity;
-	uint8_t i;
+	if (pulse & WIEGAND_PULSE_DISCONNECT) {
+		WIEGAND_STATS_INC(wr, disconnects);
+		wiegand_reader_reset_word(wr);
+		wiegand_reader_error(wr, -ENODEV);
+		return;
+	}
 
-	/* Check the parity */
-	parity = even_parity(wr->bits, 1, 12);
-	if (parity != get_bit(wr->bits, 0))
-		return -EINVAL;
+	/* The last word ended before this pulse */
+	if ((pulse & WIEGAND_PULSE_NEW_WORD) && wr->num_bits)
+		wiegand_reader_end_word(wr, 0);
+	if ((pulse & WIEGAND_PULSE_ERROR) && wr->word_err != WORD_DECODED)
+		wr->word_err = -EPROTO;
 
-	parity = odd_parity(wr->bits, 13, 24);
-	if (parity != get_bit(wr->bits, 25))
-		return -EINVAL;
+	if (wr->num_bits < WIEGAND_MAX_BITS)
+		set_word_bit(wr->bits, wr->num_bits,
+			     pulse & WIEGAND_PULSE_BIT);
+	if (wr->num_bits < UINT8_MAX)
+		wr->num_bits++;
+	/* Decode the longest words as soon as they are received */
+	if (wr->num_bits == wr->early_bits)
+		wiegand_reader_end_word(wr, 1);
+}
 
-	/* Read out the code */
-	for (card = 0, i = 1; i <= 24; i++) {
-		card <<= 1;
-		if (get_bit(wr->bits, i))
-			card |= 1;
+#if WIEGAND_PULSES_SIZE
+/* Frame the captured pulses, return the number of processed pulses */
+static uint8_t wiegand_reader_process_pulses(struct wiegand_reader *wr)
+{
+	uint8_t pulse, tail, count = 0;
+
+	for (tail = wr->pulses_tail; tail != wr->pulses_head; tail++) {
+		pulse = wr->pulses[tail & (WIEGAND_PULSES_SIZE - 1)];
+		/* Release the slot before processing the pulse */
+		wr->pulses_tail = tail + 1;
+		wiegand_reader_process_pulse(wr, pulse);
+		count++;
 	}
 
-	wiegand_reader_event(wr, WIEGAND_READER_EVENT_CARD, card);
-	return 0;
+	/* Some pulses have been lost, drop the current word */
+	if (wr->pulses_overflow) {
+		wr->pulses_overflow = 0;
+		WIEGAND_STATS_INC(wr, ring_overflows);
+		wiegand_reader_reset_word(wr);
+		wiegand_reader_error(wr, -EOVERFLOW);
+	}
+
+	/* Wait for the next bit or the end of the word */
+	if (count && wr->num_bits)
+		timer_schedule_in(&wr->word_timeout, WORD_TIMEOUT);
+
+	return count;
 }
 
-static int8_t wiegand_reader_process_34bits_code(struct wiegand_reader *wr)
+static void wiegand_reader_on_pulses(uint8_t event, union event_val val,
+				     void *context)
 {
-	// TODO
-	return -EINVAL;
+	struct wiegand_reader *wr;
+
+	/* Pulses captured from now on need a new event */
+	wiegand_pulses_queued = 0;
+	for (wr = wiegand_readers; wr; wr = wr->next)
+		wiegand_reader_process_pulses(wr);
 }
 
 static void wiegand_reader_on_word_timeout(void *context)
 {
 	struct wiegand_reader *wr = context;
-	int err = -EINVAL;
 
-	switch(wr->num_bits) {
-	case 4:
-		err = wiegand_reader_process_4bits_code(wr);
-		break;
-	case 8:
-		err = wiegand_reader_process_8bits_code(wr);
-		break;
-	case 26:
-		err = wiegand_reader_process_26bits_code(wr);
-		break;
-	case 34:
-		err = wiegand_reader_process_34bits_code(wr);
-		break;
+	/* If the main loop has been busy more pulses might be waiting */
+	if (wiegand_reader_process_pulses(wr))
+		return;
+
+	/* The interrupt handlers can't tell the word ended once the
+	 * 16 bits time wrapped, unless a pulse is already pending. */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (wr->pulses_head == wr->pulses_tail)
+			wr->in_word = 0;
 	}
+	wiegand_reader_end_word(wr, 0);
+}
 
-	wr->num_bits = 0;
-	if (err)
-		wiegand_reader_event(wr, WIEGAND_READER_ERROR, err);
+static void wiegand_reader_queue_pulse(struct wiegand_reader *wr,
+				       uint8_t pulse)
+{
+	uint8_t head = wr->pulses_head;
+
+	if ((uint8_t)(head - wr->pulses_tail) >= WIEGAND_PULSES_SIZE) {
+		wr->pulses_overflow = 1;
+		return;
+	}
+
+	wr->pulses[head & (WIEGAND_PULSES_SIZE - 1)] = pulse;
+	wr->pulses_head = head + 1;
+
+	if (!wiegand_pulses_queued &&
+	    !event_add_prio(&wiegand_readers, 0, EVENT_VAL(NULL),
+			    EVENT_PRIO_HIGH))
+		wiegand_pulses_queued = 1;
+}
+
+#define WORD_TIMEOUT_FLAGS	0
+#else
+/* Without ring the word timeout runs in the interrupt context too */
+static void wiegand_reader_on_word_timeout(void *context)
+{
+	struct wiegand_reader *wr = context;
+
+	wr->in_word = 0;
+	wiegand_reader_end_word(wr, 0);
 }
 
+static void wiegand_reader_queue_pulse(struct wiegand_reader *wr,
+				       uint8_t pulse)
+{
+	wiegand_reader_process_pulse(wr, pulse);
+	if (wr->num_bits)
+		timer_schedule_in(&wr->word_timeout, WORD_TIMEOUT);
+}
+
+#define WORD_TIMEOUT_FLAGS	TIMER_FLAG_ISR
+#endif
+
+/* Only time and classify the pulses in the interrupt handler, one
+ * ring entry per bit, the framing is done from the main loop. */
 void wiegand_reader_data_pin_changed(struct wiegand_reader *wr,
 				    uint8_t pin, uint8_t state)
 {
+	uint8_t pins = wr->data_pins;
+	uint16_t now, width;
 
 	set_bit(&wr->data_pins, pin, state);
 
-	switch (wr->data_pins & 3) {
+	switch (wr->data_pins) {
 	case 0: /* No reader */
-		wr->num_bits = 0;
-		timer_deschedule(&wr->word_timeout);
-		wiegand_reader_event(wr, WIEGAND_READER_ERROR, -ENODEV);
+		/* The lines must go back to idle before the next pulse */
+		wr->pulse_flags = WIEGAND_PULSE_DISCONNECT;
+		wr->in_word = 0;
+		if (pins)
+			wiegand_reader_queue_pulse(
+				wr, WIEGAND_PULSE_DISCONNECT);
 		return;
 	case 1: /* 1 bit */
-		if (wr->num_bits < sizeof(wr->bits) * 8)
-			set_bit(wr->bits, wr->num_bits, 1);
-		return;
 	case 2: /* 0 bit */
-		if (wr->num_bits < sizeof(wr->bits) * 8)
-			set_bit(wr->bits, wr->num_bits, 0);
+		/* Pulses must start from the idle state */
+		if (pins != 3)
+			return;
+		now = timer_get_time_us();
+		if (!wr->in_word ||
+		    (uint16_t)(now - wr->pulse_end) >= WORD_TIMEOUT_US)
+			wr->pulse_flags = WIEGAND_PULSE_NEW_WORD;
+		else if ((uint16_t)(now - wr->pulse_start) <
+			 PULSE_MIN_INTERVAL_US)
+			wr->pulse_flags = WIEGAND_PULSE_ERROR;
+		else
+			wr->pulse_flags = 0;
+		wr->in_word = 1;
+		wr->pulse_start = now;
 		return;
 	case 3: /* Inter bit */
-		wr->num_bits++;
-		timer_schedule_in(&wr->word_timeout, WORD_TIMEOUT);
+		if ((pins != 1 && pins != 2) ||
+		    (wr->pulse_flags & WIEGAND_PULSE_DISCONNECT))
+			return;
+		now = timer_get_time_us();
+		wr->pulse_end = now;
+		width = now - wr->pulse_start;
+		if (width < PULSE_MIN_WIDTH_US || width > PULSE_MAX_WIDTH_US)
+			wr->pulse_flags |= WIEGAND_PULSE_ERROR;
+		if (pins == 1)
+			wr->pulse_flags |= WIEGAND_PULSE_BIT;
+		wiegand_reader_queue_pulse(wr, wr->pulse_flags);
 		return;
 	}
 }
@@ -169,12 +575,36 @@ static void wiegand_reader_d1(uint8_t pin_state, void *context)
 	wiegand_reader_data_pin_changed(wr, 1, pin_state);
 }
 
+/* Get the length of the words to decode early, 0 to never do it */
+static uint8_t wiegand_reader_early_bits(uint8_t formats)
+{
+	uint8_t i, num_bits, early_bits = 0;
+
+	if (WIEGAND_EARLY_DECODE == WIEGAND_EARLY_DECODE_NONE)
+		return 0;
+	if (WIEGAND_EARLY_DECODE == WIEGAND_EARLY_DECODE_TABLE)
+		formats = BIT(WIEGAND_FORMAT_COUNT) - 1;
+
+	for (i = 0; i < ARRAY_SIZE(wiegand_formats); i++) {
+		if (!(formats & BIT(i)))
+			continue;
+		num_bits = pgm_read_byte(&wiegand_formats[i].num_bits);
+		if (num_bits > early_bits)
+			early_bits = num_bits;
+	}
+
+	return early_bits;
+}
+
 int8_t wiegand_reader_init(struct wiegand_reader *wr,
-			   uint8_t d0_irq, uint8_t d1_irq)
+			   uint8_t d0_irq, uint8_t d1_irq, uint8_t formats)
 {
+	struct wiegand_reader **last;
 	int8_t err;
 
 	memset(wr, 0, sizeof(*wr));
+	wr->formats = formats & (BIT(WIEGAND_FORMAT_COUNT) - 1);
+	wr->early_bits = wiegand_reader_early_bits(wr->formats);
 
 	err = external_irq_setup(d0_irq, 1, IRQ_TRIGGER_BOTH_EDGE,
 				 wiegand_reader_d0, wr);
@@ -186,7 +616,24 @@ int8_t wiegand_reader_init(struct wiegand_reader *wr,
 	if (err)
 		return err;
 
-	timer_init(&wr->word_timeout, wiegand_reader_on_word_timeout, wr);
+	timer_init(&wr->word_timeout, wiegand_reader_on_word_timeout, wr,
+		   WORD_TIMEOUT_FLAGS);
+
+#if WIEGAND_PULSES_SIZE
+	if (!wiegand_readers) {
+		wiegand_pulses_handler.source = &wiegand_readers;
+		wiegand_pulses_handler.source_id =
+			EVENT_SOURCE_WIEGAND_PULSES;
+		wiegand_pulses_handler.handler = wiegand_reader_on_pulses;
+		err = event_handler_add(&wiegand_pulses_handler);
+		if (err)
+			return err;
+	}
+#endif
+	/* Keep the readers in the initialization order */
+	for (last = &wiegand_readers; *last; last = &(*last)->next)
+		;
+	*last = wr;
 
 	set_bit(&wr->data_pins, 0, gpio_get_value(
 			external_irq_get_gpio(d0_irq)));
@@ -197,3 +644,26 @@ int8_t wiegand_reader_init(struct wiegand_reader *wr,
 
 	return 0;
 }
+
+#if WIEGAND_READER_STATS
+int8_t wiegand_reader_get_stats(uint8_t index,
+				struct wiegand_reader_stats *stats,
+				uint8_t reset)
+{
+	struct wiegand_reader *wr = wiegand_readers;
+
+	while (wr && index--)
+		wr = wr->next;
+	if (!wr)
+		return -EINVAL;
+
+	/* The interrupt handlers update the statistics without ring */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(stats, &wr->stats, sizeof(*stats));
+		if (reset)
+			memset(&wr->stats, 0, sizeof(wr->stats));
+	}
+
+	return 0;
+}
+#endif
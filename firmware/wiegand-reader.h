@@ -3,12 +3,139 @@
 
 #include <stdint.h>
 #include "timer.h"
+#include "utils.h"
+
+/* Length of the longest word that can be received */
+#define WIEGAND_MAX_BITS		40
+
+/* Card formats, their index in the formats bitmask */
+#define WIEGAND_FORMAT_H10301		0 /* 26 bits */
+#define WIEGAND_FORMAT_H10306		1 /* 34 bits */
+#define WIEGAND_FORMAT_C1000_35		2 /* 35 bits, Corporate 1000 */
+#define WIEGAND_FORMAT_H10304		3 /* 37 bits, facility < 8192 */
+#define WIEGAND_FORMAT_COUNT		4
+
+#define WIEGAND_FORMATS_DEFAULT		BIT(WIEGAND_FORMAT_H10301)
+
+/** Time in ms without pulses that ends a word. The words that are not
+ * decoded early, like the keys, are only processed after it. Readers
+ * usually send the bits 2ms apart at most, a shorter timeout makes the
+ * keypads more responsive but might cut the words of slow readers. */
+#ifndef WIEGAND_WORD_TIMEOUT
+#define WIEGAND_WORD_TIMEOUT		10
+#endif
+
+/* When to decode a word without waiting for the timeout */
+/* Never, always wait for the timeout */
+#define WIEGAND_EARLY_DECODE_NONE	0
+/* At the length of the longest format of the table, 37 bits */
+#define WIEGAND_EARLY_DECODE_TABLE	1
+/* At the length of the longest format accepted by the reader */
+#define WIEGAND_EARLY_DECODE_ENABLED	2
+
+/** A word reaching the early decode length is decoded right away and
+ * ignored if it can't be decoded, in case it is the start of a longer
+ * word. If more bits follow a decoded word they are dropped and an
+ * -EOVERFLOW error is reported after the card event.
+ *
+ * With WIEGAND_EARLY_DECODE_ENABLED the accepted cards don't wait for
+ * the timeout, but a longer card from a format that is not accepted
+ * is read as a shorter card if its first bits pass the parity checks.
+ * WIEGAND_EARLY_DECODE_TABLE only decodes early the words that can't
+ * be the start of a longer card, but everything shorter than 37 bits
+ * waits for the timeout. The keys are never decoded early. */
+#ifndef WIEGAND_EARLY_DECODE
+#define WIEGAND_EARLY_DECODE		WIEGAND_EARLY_DECODE_ENABLED
+#endif
+
+/** Number of pulses that can be captured before the main loop process
+ * them, it must be a power of 2 and at most 128. The main loop can be
+ * blocked for seconds by the EEPROM writes of a large access list
+ * update, the default holds a 37 bits card and most of a second one.
+ * With 0 the words are framed in the interrupt handlers instead, this
+ * save the RAM of the ring but make the interrupts longer. */
+#ifndef WIEGAND_PULSES_SIZE
+#define WIEGAND_PULSES_SIZE		64
+#endif
+
+/* The pulses are classified by the interrupt handlers, each ring
+ * entry holds the bit value and the following flags. */
+#define WIEGAND_PULSE_BIT		BIT(0)
+/* The pulse starts a new word */
+#define WIEGAND_PULSE_NEW_WORD		BIT(1)
+/* The pulse was too short, too long or too close to the previous one */
+#define WIEGAND_PULSE_ERROR		BIT(2)
+/* Not a pulse, both data lines went low */
+#define WIEGAND_PULSE_DISCONNECT	BIT(7)
+
+/** Keep the statistics of each reader, see wiegand_reader_get_stats() */
+#ifndef WIEGAND_READER_STATS
+#define WIEGAND_READER_STATS		1
+#endif
+
+/* Word lengths counted in the statistics: the keys, each card
+ * format and all the other lengths */
+#define WIEGAND_STATS_WORDS_KEY4	0
+#define WIEGAND_STATS_WORDS_KEY8	1
+#define WIEGAND_STATS_WORDS_FORMAT(f)	(2 + (f))
+#define WIEGAND_STATS_WORDS_OTHER	(2 + WIEGAND_FORMAT_COUNT)
+#define WIEGAND_STATS_WORDS_LENGTHS	(3 + WIEGAND_FORMAT_COUNT)
+
+/* All the counters saturate */
+struct wiegand_reader_stats {
+	/* Received words by length */
+	uint16_t words[WIEGAND_STATS_WORDS_LENGTHS];
+	/* Words with a bad parity, or bad 8 bits keys */
+	uint16_t parity_errors;
+	/* Words without any accepted format of this length, or cards
+	 * that don't fit in 32 bits */
+	uint16_t unsupported;
+	/* Words with pulses too short, too long or too close */
+	uint16_t pulse_errors;
+	/* Words longer than WIEGAND_MAX_BITS */
+	uint16_t overflows;
+	/* Words dropped because the pulses ring was full */
+	uint16_t ring_overflows;
+	/* Number of times the reader got disconnected */
+	uint16_t disconnects;
+	/* Time of the last error from timer_get_time(), and its code */
+	uint32_t last_error_time;
+	int8_t last_error;
+};
 
 struct wiegand_reader {
-	uint8_t bits[5]; /* For up to 34 bits */
+	struct wiegand_reader *next;
+#if WIEGAND_READER_STATS
+	struct wiegand_reader_stats stats;
+#endif
+
+	/* The first received bit is the MSB of the first byte */
+	uint8_t bits[WIEGAND_MAX_BITS / 8];
 	uint8_t num_bits;
+	/* Bitmask of the accepted card formats */
+	uint8_t formats;
+	/* Length of the words to decode without waiting for the timeout */
+	uint8_t early_bits;
+	/* Error found while receiving the word */
+	int8_t word_err;
 
+#if WIEGAND_PULSES_SIZE
+	/* Ring of the pulses captured by the interrupt handlers, the
+	 * head is only written by them and the tail by the main loop */
+	uint8_t pulses[WIEGAND_PULSES_SIZE];
+	uint8_t volatile pulses_head;
+	uint8_t volatile pulses_tail;
+	uint8_t volatile pulses_overflow;
+#endif
+
+	/* State of the interrupt handlers: the data lines, the start and
+	 * end time of the last pulse and the flags of the current one. The
+	 * main loop clears in_word once the word ended on its timeout. */
 	uint8_t data_pins;
+	uint16_t pulse_start;
+	uint16_t pulse_end;
+	uint8_t pulse_flags;
+	uint8_t volatile in_word;
 
 	struct timer word_timeout;
 };
@@ -40,9 +167,23 @@ struct wiegand_reader {
 /** Initialize the Wiegand reader object.
  *
  * To use this reader the user should register an event handler
- * on the reader.
+ * on the reader. The keypad codes are always accepted, the cards
+ * only in the formats set in the formats bitmask. The value of the
+ * card events is the facility code followed by the card number. The
+ * cards that don't fit in 32 bits, H10304 cards with a facility code
+ * of 8192 or more, are rejected with an -ERANGE error.
  */
 int8_t wiegand_reader_init(struct wiegand_reader *wr,
-			   uint8_t d0_irq, uint8_t d1_irq);
+			   uint8_t d0_irq, uint8_t d1_irq, uint8_t formats);
+
+#if WIEGAND_READER_STATS
+/** Get the statistics of a reader
+ *
+ * The readers are numbered in the order they have been initialized.
+ */
+int8_t wiegand_reader_get_stats(uint8_t index,
+				struct wiegand_reader_stats *stats,
+				uint8_t reset);
+#endif
 
 #endif /* WIEGAND_READER_H */